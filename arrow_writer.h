@@ -0,0 +1,605 @@
+#ifndef MBASE_NLQ_ARROW_WRITER_H
+#define MBASE_NLQ_ARROW_WRITER_H
+
+#include <mbase/common.h>
+#include <mbase/string.h>
+#include <mbase/vector.h>
+#include <libpq-fe.h>
+#include <string>
+#include <cstdlib>
+#include "db_decode.h"
+#include "result_writer.h"
+
+MBASE_BEGIN
+
+/*
+    Arrow IPC stream writer for a buffered result set.
+    Output is a schema message, a single record batch and the end of stream marker, see:
+    https://arrow.apache.org/docs/format/Columnar.html#serialization-and-interprocess-communication-ipc
+
+    Message metadata are flatbuffers, they are built here by hand since only a handful of tables are needed.
+*/
+
+#define NLQ_ARROW_CONTENT_TYPE "application/vnd.apache.arrow.stream"
+#define NLQ_ARROW_METADATA_V5 4
+#define NLQ_ARROW_HEADER_SCHEMA 1
+#define NLQ_ARROW_HEADER_RECORD_BATCH 3
+#define NLQ_ARROW_TYPE_INT 2
+#define NLQ_ARROW_TYPE_FLOATING_POINT 3
+#define NLQ_ARROW_TYPE_UTF8 5
+#define NLQ_ARROW_TYPE_BOOL 6
+#define NLQ_ARROW_TYPE_DATE 8
+#define NLQ_ARROW_TYPE_TIMESTAMP 10
+#define NLQ_ARROW_PRECISION_SINGLE 1
+#define NLQ_ARROW_PRECISION_DOUBLE 2
+#define NLQ_ARROW_DATE_UNIT_DAY 0
+#define NLQ_ARROW_TIME_UNIT_MICROSECOND 2
+#define NLQ_ARROW_EPOCH_MICROS_OFFSET 946684800000000LL // 2000-01-01 in unix microseconds
+
+/*
+    Front to back flatbuffer builder.
+    Parents are written before their children, so every offset slot is patched once its target is written.
+    Tables are laid out so that the first field after the vtable offset is 8 byte aligned
+    and the fields are sorted by their size, which keeps every scalar naturally aligned.
+*/
+class ArrowFlatBuilder {
+public:
+    struct table_field {
+        U16 mId;
+        U8 mSize;
+        U64 mValue; // ignored for offsets
+        bool bIsOffset;
+    };
+
+    ArrowFlatBuilder()
+    {
+        put_scalar(0, 4); // root table offset
+    }
+
+    // Returns the position of the table, out_slots[i] receives the slot position of in_fields[i] if it is an offset
+    size_type write_table(const table_field* in_fields, I32 in_count, size_type* out_slots)
+    {
+        I32 maxId = -1;
+        I32 fieldOrder[8];
+        for(I32 i = 0; i < in_count; ++i)
+        {
+            maxId = in_fields[i].mId > maxId ? in_fields[i].mId : maxId;
+
+            // insertion sort by size, largest first
+            I32 j = i;
+            for(; j > 0 && in_fields[fieldOrder[j - 1]].mSize < in_fields[i].mSize; --j)
+            {
+                fieldOrder[j] = fieldOrder[j - 1];
+            }
+            fieldOrder[j] = i;
+        }
+
+        U16 fieldOffsets[8];
+        U16 inlineSize = 4;
+        for(I32 i = 0; i < in_count; ++i)
+        {
+            fieldOffsets[fieldOrder[i]] = inlineSize;
+            inlineSize += in_fields[fieldOrder[i]].mSize;
+        }
+
+        size_type vtableSize = 4 + 2 * (maxId + 1);
+        while((mBuffer.size() + vtableSize) % 8 != 4)
+        {
+            mBuffer += '\0';
+        }
+        size_type vtablePos = mBuffer.size();
+        put_scalar(vtableSize, 2);
+        put_scalar(inlineSize, 2);
+        for(I32 fieldId = 0; fieldId <= maxId; ++fieldId)
+        {
+            U16 fieldOffset = 0;
+            for(I32 i = 0; i < in_count; ++i)
+            {
+                if(in_fields[i].mId == fieldId)
+                {
+                    fieldOffset = fieldOffsets[i];
+                }
+            }
+            put_scalar(fieldOffset, 2);
+        }
+
+        size_type tablePos = mBuffer.size();
+        put_scalar(tablePos - vtablePos, 4);
+        for(I32 i = 0; i < in_count; ++i)
+        {
+            const table_field& tableField = in_fields[fieldOrder[i]];
+            if(tableField.bIsOffset)
+            {
+                out_slots[fieldOrder[i]] = mBuffer.size();
+                put_scalar(0, 4);
+            }
+            else
+            {
+                put_scalar(tableField.mValue, tableField.mSize);
+            }
+        }
+        return tablePos;
+    }
+
+    size_type write_string(const char* in_data, size_type in_length)
+    {
+        align_to(4, 0);
+        size_type stringPos = mBuffer.size();
+        put_scalar(in_length, 4);
+        mBuffer.append(in_data, in_length);
+        mBuffer += '\0';
+        return stringPos;
+    }
+
+    // Element slots are at the returned position + 4 + 4 * i
+    size_type write_offset_vector(size_type in_count)
+    {
+        align_to(4, 0);
+        size_type vectorPos = mBuffer.size();
+        put_scalar(in_count, 4);
+        mBuffer.append(in_count * 4, '\0');
+        return vectorPos;
+    }
+
+    // Vector of structs made of two longs (FieldNode and Buffer)
+    size_type write_long_pair_vector(const mbase::vector<U64>& in_values)
+    {
+        align_to(8, 4);
+        size_type vectorPos = mBuffer.size();
+        put_scalar(in_values.size() / 2, 4);
+        for(U64 longValue : in_values)
+        {
+            put_scalar(longValue, 8);
+        }
+        return vectorPos;
+    }
+
+    GENERIC patch_offset(size_type in_slot, size_type in_target)
+    {
+        U64 relativeOffset = in_target - in_slot;
+        for(I32 i = 0; i < 4; ++i)
+        {
+            mBuffer[in_slot + i] = (char)(relativeOffset >> (8 * i));
+        }
+    }
+
+    const std::string& get_buffer() const
+    {
+        return mBuffer;
+    }
+
+private:
+    GENERIC put_scalar(U64 in_value, I32 in_size)
+    {
+        for(I32 i = 0; i < in_size; ++i)
+        {
+            mBuffer += (char)(in_value >> (8 * i));
+        }
+    }
+
+    GENERIC align_to(size_type in_alignment, size_type in_bias)
+    {
+        while((mBuffer.size() + in_bias) % in_alignment)
+        {
+            mBuffer += '\0';
+        }
+    }
+
+    std::string mBuffer;
+};
+
+enum class arrow_column_kind : U8 {
+    INT16,
+    INT32,
+    INT64,
+    UINT32,
+    FLOAT32,
+    FLOAT64,
+    BOOL,
+    DATE32,
+    TIMESTAMP,
+    TIMESTAMPTZ,
+    UTF8 // numeric, uuid, json and every other type as its text form
+};
+
+inline arrow_column_kind arrow_kind_from_oid(Oid in_type)
+{
+    switch(in_type)
+    {
+    case NLQ_PSQL_OID_INT2: return arrow_column_kind::INT16;
+    case NLQ_PSQL_OID_INT4: return arrow_column_kind::INT32;
+    case NLQ_PSQL_OID_INT8: return arrow_column_kind::INT64;
+    case NLQ_PSQL_OID_OID: return arrow_column_kind::UINT32;
+    case NLQ_PSQL_OID_FLOAT4: return arrow_column_kind::FLOAT32;
+    case NLQ_PSQL_OID_FLOAT8: return arrow_column_kind::FLOAT64;
+    case NLQ_PSQL_OID_BOOL: return arrow_column_kind::BOOL;
+    case NLQ_PSQL_OID_DATE: return arrow_column_kind::DATE32;
+    case NLQ_PSQL_OID_TIMESTAMP: return arrow_column_kind::TIMESTAMP;
+    case NLQ_PSQL_OID_TIMESTAMPTZ: return arrow_column_kind::TIMESTAMPTZ;
+    default: return arrow_column_kind::UTF8;
+    }
+}
+
+inline I32 arrow_kind_width(arrow_column_kind in_kind)
+{
+    switch(in_kind)
+    {
+    case arrow_column_kind::INT16: return 2;
+    case arrow_column_kind::INT32:
+    case arrow_column_kind::UINT32:
+    case arrow_column_kind::FLOAT32:
+    case arrow_column_kind::DATE32: return 4;
+    case arrow_column_kind::INT64:
+    case arrow_column_kind::FLOAT64:
+    case arrow_column_kind::TIMESTAMP:
+    case arrow_column_kind::TIMESTAMPTZ: return 8;
+    default: return 0;
+    }
+}
+
+inline U8 arrow_type_id(arrow_column_kind in_kind)
+{
+    switch(in_kind)
+    {
+    case arrow_column_kind::FLOAT32:
+    case arrow_column_kind::FLOAT64: return NLQ_ARROW_TYPE_FLOATING_POINT;
+    case arrow_column_kind::BOOL: return NLQ_ARROW_TYPE_BOOL;
+    case arrow_column_kind::DATE32: return NLQ_ARROW_TYPE_DATE;
+    case arrow_column_kind::TIMESTAMP:
+    case arrow_column_kind::TIMESTAMPTZ: return NLQ_ARROW_TYPE_TIMESTAMP;
+    case arrow_column_kind::UTF8: return NLQ_ARROW_TYPE_UTF8;
+    default: return NLQ_ARROW_TYPE_INT;
+    }
+}
+
+// Writes the type table of a field, the table layout depends on the union type
+inline size_type arrow_write_field_type(ArrowFlatBuilder& in_builder, arrow_column_kind in_kind)
+{
+    size_type typeSlots[2];
+    switch(in_kind)
+    {
+    case arrow_column_kind::INT16:
+    case arrow_column_kind::INT32:
+    case arrow_column_kind::INT64:
+    case arrow_column_kind::UINT32:
+    {
+        ArrowFlatBuilder::table_field intFields[] = {
+            {0, 4, (U64)arrow_kind_width(in_kind) * 8, false},
+            {1, 1, in_kind != arrow_column_kind::UINT32, false}
+        };
+        return in_builder.write_table(intFields, 2, typeSlots);
+    }
+    case arrow_column_kind::FLOAT32:
+    case arrow_column_kind::FLOAT64:
+    {
+        ArrowFlatBuilder::table_field floatFields[] = {
+            {0, 2, in_kind == arrow_column_kind::FLOAT32 ? (U64)NLQ_ARROW_PRECISION_SINGLE : (U64)NLQ_ARROW_PRECISION_DOUBLE, false}
+        };
+        return in_builder.write_table(floatFields, 1, typeSlots);
+    }
+    case arrow_column_kind::DATE32:
+    {
+        // the schema default is milliseconds, so the unit is always written
+        ArrowFlatBuilder::table_field dateFields[] = {
+            {0, 2, NLQ_ARROW_DATE_UNIT_DAY, false}
+        };
+        return in_builder.write_table(dateFields, 1, typeSlots);
+    }
+    case arrow_column_kind::TIMESTAMP:
+    case arrow_column_kind::TIMESTAMPTZ:
+    {
+        ArrowFlatBuilder::table_field timestampFields[] = {
+            {0, 2, NLQ_ARROW_TIME_UNIT_MICROSECOND, false},
+            {1, 4, 0, true}
+        };
+        I32 fieldCount = in_kind == arrow_column_kind::TIMESTAMPTZ ? 2 : 1;
+        size_type typePos = in_builder.write_table(timestampFields, fieldCount, typeSlots);
+        if(fieldCount == 2)
+        {
+            in_builder.patch_offset(typeSlots[1], in_builder.write_string("UTC", 3));
+        }
+        return typePos;
+    }
+    default:
+        return in_builder.write_table(nullptr, 0, typeSlots); // Bool and Utf8 have no fields
+    }
+}
+
+inline GENERIC arrow_write_schema_metadata(ArrowFlatBuilder& in_builder, const mbase::vector<psql_column_decoder>& in_decoders, const mbase::string& in_sql)
+{
+    size_type messageSlots[4];
+    ArrowFlatBuilder::table_field messageFields[] = {
+        {0, 2, NLQ_ARROW_METADATA_V5, false},
+        {1, 1, NLQ_ARROW_HEADER_SCHEMA, false},
+        {2, 4, 0, true},
+        {3, 8, 0, false}
+    };
+    in_builder.patch_offset(0, in_builder.write_table(messageFields, 4, messageSlots));
+
+    size_type schemaSlots[3];
+    ArrowFlatBuilder::table_field schemaFields[] = {
+        {0, 2, 0, false}, // little endian
+        {1, 4, 0, true},
+        {2, 4, 0, true}
+    };
+    in_builder.patch_offset(messageSlots[2], in_builder.write_table(schemaFields, 3, schemaSlots));
+
+    size_type fieldsVector = in_builder.write_offset_vector(in_decoders.size());
+    in_builder.patch_offset(schemaSlots[1], fieldsVector);
+    for(size_type i = 0; i < in_decoders.size(); ++i)
+    {
+        size_type fieldSlots[5];
+        arrow_column_kind columnKind = arrow_kind_from_oid(in_decoders[i].mType);
+        ArrowFlatBuilder::table_field fieldFields[] = {
+            {0, 4, 0, true},
+            {1, 1, 1, false}, // nullable
+            {2, 1, arrow_type_id(columnKind), false},
+            {3, 4, 0, true},
+            {5, 4, 0, true} // children, readers expect the vector even if it is empty
+        };
+        size_type fieldPos = in_builder.write_table(fieldFields, 5, fieldSlots);
+        in_builder.patch_offset(fieldsVector + 4 + 4 * i, fieldPos);
+        in_builder.patch_offset(fieldSlots[0], in_builder.write_string(in_decoders[i].mName.c_str(), in_decoders[i].mName.size()));
+
+        in_builder.patch_offset(fieldSlots[3], arrow_write_field_type(in_builder, columnKind));
+        in_builder.patch_offset(fieldSlots[4], in_builder.write_offset_vector(0));
+    }
+
+    // the generated SQL travels with the schema
+    size_type metadataVector = in_builder.write_offset_vector(1);
+    in_builder.patch_offset(schemaSlots[2], metadataVector);
+    size_type keyValueSlots[2];
+    ArrowFlatBuilder::table_field keyValueFields[] = {
+        {0, 4, 0, true},
+        {1, 4, 0, true}
+    };
+    in_builder.patch_offset(metadataVector + 4, in_builder.write_table(keyValueFields, 2, keyValueSlots));
+    in_builder.patch_offset(keyValueSlots[0], in_builder.write_string("nlquery.sql", 11));
+    in_builder.patch_offset(keyValueSlots[1], in_builder.write_string(in_sql.c_str(), in_sql.size()));
+}
+
+// Encapsulated message: continuation marker, metadata length, metadata padded to 8 bytes, body
+inline GENERIC arrow_write_message(std::string& out_stream, const std::string& in_metadata, const std::string& in_body)
+{
+    size_type metadataSize = (in_metadata.size() + 7) & ~(size_type)7;
+    U32 messagePrefix[2] = {0xFFFFFFFF, (U32)metadataSize};
+    for(U32 prefixWord : messagePrefix)
+    {
+        for(I32 i = 0; i < 4; ++i)
+        {
+            out_stream += (char)(prefixWord >> (8 * i));
+        }
+    }
+    out_stream += in_metadata;
+    out_stream.append(metadataSize - in_metadata.size(), '\0');
+    out_stream += in_body;
+}
+
+inline GENERIC arrow_pad_body(std::string& out_body)
+{
+    out_body.append(((out_body.size() + 7) & ~(size_type)7) - out_body.size(), '\0');
+}
+
+inline GENERIC arrow_put_le(std::string& out_body, size_type in_pos, U64 in_value, I32 in_size)
+{
+    for(I32 i = 0; i < in_size; ++i)
+    {
+        out_body[in_pos + i] = (char)(in_value >> (8 * i));
+    }
+}
+
+// Decodes a non-null cell into the fixed width representation of its arrow type, false means the value has no representation (infinity)
+inline bool arrow_decode_fixed_cell(const psql_column_decoder& in_decoder, arrow_column_kind in_kind, const PGresult* in_result, I32 in_row, U64& out_value)
+{
+    const char* cellData = PQgetvalue(in_result, in_row, in_decoder.mColumnIndex);
+    I32 cellLength = PQgetlength(in_result, in_row, in_decoder.mColumnIndex);
+    switch(in_kind)
+    {
+    case arrow_column_kind::FLOAT32:
+    case arrow_column_kind::FLOAT64:
+    {
+        F64 floatValue = in_decoder.bIsBinary ? psql_decode_binary_float(cellData, cellLength) : strtod(cellData, nullptr);
+        if(in_kind == arrow_column_kind::FLOAT32)
+        {
+            F32 singleValue = (F32)floatValue;
+            U32 singleBits;
+            memcpy(&singleBits, &singleValue, sizeof(singleBits));
+            out_value = singleBits;
+            return true;
+        }
+        memcpy(&out_value, &floatValue, sizeof(out_value));
+        return true;
+    }
+    case arrow_column_kind::DATE32:
+    {
+        I64 unixDays = 0;
+        if(in_decoder.bIsBinary)
+        {
+            I32 pgDays = (I32)psql_read_u32(cellData);
+            if(pgDays == INT32_MAX || pgDays == INT32_MIN)
+            {
+                return false;
+            }
+            unixDays = (I64)pgDays + NLQ_PSQL_EPOCH_DAY_OFFSET;
+        }
+        else if(!psql_parse_text_date(cellData, unixDays))
+        {
+            return false;
+        }
+        out_value = (U64)unixDays;
+        return true;
+    }
+    case arrow_column_kind::TIMESTAMP:
+    case arrow_column_kind::TIMESTAMPTZ:
+    {
+        I64 unixMicros = 0;
+        if(in_decoder.bIsBinary)
+        {
+            I64 pgMicros = (I64)psql_read_u64(cellData);
+            if(pgMicros == INT64_MAX || pgMicros == INT64_MIN)
+            {
+                return false;
+            }
+            unixMicros = pgMicros + NLQ_ARROW_EPOCH_MICROS_OFFSET;
+        }
+        else if(!psql_parse_text_timestamp(cellData, unixMicros))
+        {
+            return false;
+        }
+        out_value = (U64)unixMicros;
+        return true;
+    }
+    default:
+        out_value = in_decoder.bIsBinary ? (U64)psql_decode_binary_integer(cellData, cellLength, in_decoder.mType) : (U64)strtoll(cellData, nullptr, 10);
+        return true;
+    }
+}
+
+/*
+    Writes the buffers of a single column into the record batch body.
+    out_nodes receives the FieldNode (length, null count), out_buffers receives (offset, length) of every buffer.
+*/
+inline GENERIC arrow_write_column(std::string& out_body, const PsqlResultBuffer& in_rows, const psql_column_decoder& in_decoder, mbase::vector<U64>& out_nodes, mbase::vector<U64>& out_buffers)
+{
+    arrow_column_kind columnKind = arrow_kind_from_oid(in_decoder.mType);
+    size_type rowCount = in_rows.get_row_count();
+    size_type bitmapLength = (rowCount + 7) / 8;
+    U64 nullCount = 0;
+
+    // every column starts with the validity bitmap, bits are set for the valid rows
+    size_type validityPos = out_body.size();
+    out_body.append(bitmapLength, '\0');
+    arrow_pad_body(out_body);
+    out_buffers.push_back(validityPos);
+    out_buffers.push_back(bitmapLength);
+
+    size_type dataPos = out_body.size();
+    size_type offsetsPos = 0;
+    I32 valueWidth = arrow_kind_width(columnKind);
+    if(columnKind == arrow_column_kind::BOOL)
+    {
+        out_body.append(bitmapLength, '\0');
+    }
+    else if(columnKind == arrow_column_kind::UTF8)
+    {
+        offsetsPos = dataPos;
+        out_body.append((rowCount + 1) * 4, '\0');
+        arrow_pad_body(out_body);
+        dataPos = out_body.size();
+    }
+    else
+    {
+        out_body.append(rowCount * valueWidth, '\0');
+    }
+
+    size_type rowIndex = 0;
+    for(const PGresult* resultBatch : in_rows.get_batches())
+    {
+        I32 batchRows = PQntuples(resultBatch);
+        for(I32 j = 0; j < batchRows; ++j, ++rowIndex)
+        {
+            bool isValid = !PQgetisnull(resultBatch, j, in_decoder.mColumnIndex);
+            if(isValid)
+            {
+                if(columnKind == arrow_column_kind::UTF8)
+                {
+                    psql_append_cell_text(in_decoder, resultBatch, j, out_body);
+                }
+                else if(columnKind == arrow_column_kind::BOOL)
+                {
+                    const char* cellData = PQgetvalue(resultBatch, j, in_decoder.mColumnIndex);
+                    if(in_decoder.bIsBinary ? cellData[0] != 0 : cellData[0] == 't')
+                    {
+                        out_body[dataPos + rowIndex / 8] |= (char)(1 << (rowIndex % 8));
+                    }
+                }
+                else
+                {
+                    U64 fixedValue = 0;
+                    isValid = arrow_decode_fixed_cell(in_decoder, columnKind, resultBatch, j, fixedValue);
+                    if(isValid)
+                    {
+                        arrow_put_le(out_body, dataPos + rowIndex * valueWidth, fixedValue, valueWidth);
+                    }
+                }
+            }
+
+            if(isValid)
+            {
+                out_body[validityPos + rowIndex / 8] |= (char)(1 << (rowIndex % 8));
+            }
+            else
+            {
+                ++nullCount;
+            }
+
+            if(columnKind == arrow_column_kind::UTF8)
+            {
+                arrow_put_le(out_body, offsetsPos + (rowIndex + 1) * 4, out_body.size() - dataPos, 4);
+            }
+        }
+    }
+
+    if(columnKind == arrow_column_kind::UTF8)
+    {
+        out_buffers.push_back(offsetsPos);
+        out_buffers.push_back((rowCount + 1) * 4);
+    }
+    out_buffers.push_back(dataPos);
+    out_buffers.push_back(out_body.size() - dataPos);
+    arrow_pad_body(out_body);
+
+    out_nodes.push_back(rowCount);
+    out_nodes.push_back(nullCount);
+}
+
+/*
+    Writes the whole result set as an arrow IPC stream.
+    The generated SQL is stored in the schema metadata under "nlquery.sql".
+*/
+inline GENERIC nlq_write_arrow_stream(std::string& out_stream, const mbase::string& in_sql, const PsqlResultBuffer& in_rows)
+{
+    const mbase::vector<psql_column_decoder>& columnDecoders = in_rows.get_decoders();
+    out_stream.clear();
+    out_stream.reserve(in_sql.size() + 1024 + in_rows.get_payload_size() + (size_type)in_rows.get_row_count() * columnDecoders.size() * 8);
+
+    ArrowFlatBuilder schemaBuilder;
+    arrow_write_schema_metadata(schemaBuilder, columnDecoders, in_sql);
+    arrow_write_message(out_stream, schemaBuilder.get_buffer(), std::string());
+
+    std::string batchBody;
+    mbase::vector<U64> fieldNodes;
+    mbase::vector<U64> bodyBuffers;
+    for(const psql_column_decoder& columnDecoder : columnDecoders)
+    {
+        arrow_write_column(batchBody, in_rows, columnDecoder, fieldNodes, bodyBuffers);
+    }
+
+    ArrowFlatBuilder batchBuilder;
+    size_type messageSlots[4];
+    ArrowFlatBuilder::table_field messageFields[] = {
+        {0, 2, NLQ_ARROW_METADATA_V5, false},
+        {1, 1, NLQ_ARROW_HEADER_RECORD_BATCH, false},
+        {2, 4, 0, true},
+        {3, 8, batchBody.size(), false}
+    };
+    batchBuilder.patch_offset(0, batchBuilder.write_table(messageFields, 4, messageSlots));
+
+    size_type batchSlots[3];
+    ArrowFlatBuilder::table_field batchFields[] = {
+        {0, 8, (U64)in_rows.get_row_count(), false},
+        {1, 4, 0, true},
+        {2, 4, 0, true}
+    };
+    batchBuilder.patch_offset(messageSlots[2], batchBuilder.write_table(batchFields, 3, batchSlots));
+    batchBuilder.patch_offset(batchSlots[1], batchBuilder.write_long_pair_vector(fieldNodes));
+    batchBuilder.patch_offset(batchSlots[2], batchBuilder.write_long_pair_vector(bodyBuffers));
+    arrow_write_message(out_stream, batchBuilder.get_buffer(), batchBody);
+
+    // end of stream
+    out_stream.append("\xFF\xFF\xFF\xFF\0\0\0\0", 8);
+}
+
+MBASE_END
+
+#endif // MBASE_NLQ_ARROW_WRITER_H
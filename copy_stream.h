@@ -0,0 +1,114 @@
+#ifndef MBASE_NLQ_COPY_STREAM_H
+#define MBASE_NLQ_COPY_STREAM_H
+
+#include <mbase/common.h>
+#include <memory>
+#include <string>
+#include "db_ops.h"
+#include "nlq_status.h"
+
+MBASE_BEGIN
+
+#define MBASE_NLQ_COPY_CHUNK_SIZE 65536
+
+/*
+    Produces the body of a CSV export for a COPY that is already started with psql_start_copy.
+    CopyData messages are forwarded as they arrive, so the memory use doesn't depend on the export size.
+    Since the body is already on its way, the final status is reported by the caller in an HTTP trailer.
+*/
+class PsqlCopyStream {
+public:
+    PsqlCopyStream(std::unique_ptr<PostgrePooledConnection>&& in_connection, I32 in_max_rows, I64 in_max_bytes) :
+        mConnection(std::move(in_connection)),
+        mMaxRows(in_max_rows),
+        mMaxBytes(in_max_bytes)
+    {
+    }
+
+    ~PsqlCopyStream()
+    {
+        if(!bIsFinished)
+        {
+            // client went away in the middle of the export, the pool closes the busy connection
+            psql_cancel_query(mConnection->get_connection_ptr());
+        }
+    }
+
+    PsqlCopyStream(const PsqlCopyStream&) = delete;
+    PsqlCopyStream& operator=(const PsqlCopyStream&) = delete;
+
+    // Appends the next piece of the CSV to out_chunk. Returns false once the export is complete.
+    bool next_chunk(std::string& out_chunk)
+    {
+        if(bIsFinished)
+        {
+            return false;
+        }
+
+        PGconn* dbConnection = mConnection->get_connection_ptr();
+        while(out_chunk.size() < MBASE_NLQ_COPY_CHUNK_SIZE)
+        {
+            char* copyData = nullptr;
+            I32 copyLength = PQgetCopyData(dbConnection, &copyData, 0);
+            if(copyLength < 0)
+            {
+                finish(copyLength == -1 ? NLQ_SUCCESS : NLQ_DB_ERR);
+                return false;
+            }
+
+            // every CopyData message is a single CSV line, the first one is the header
+            if(mLineCount++ > mMaxRows || mByteCount + copyLength > mMaxBytes)
+            {
+                PQfreemem(copyData);
+                psql_cancel_query(dbConnection);
+
+                // the connection leaves the COPY OUT state only after the remaining data is read
+                while(PQgetCopyData(dbConnection, &copyData, 0) >= 0)
+                {
+                    PQfreemem(copyData);
+                }
+                finish(NLQ_TOO_MUCH_DATA);
+                return false;
+            }
+            mByteCount += copyLength;
+            out_chunk.append(copyData, copyLength);
+            PQfreemem(copyData);
+        }
+        return true;
+    }
+
+    // Valid once next_chunk returned false
+    I32 get_status() const
+    {
+        return mStatus;
+    }
+
+private:
+    GENERIC finish(I32 in_status)
+    {
+        // the command status of the COPY, or the error that ended it
+        PGconn* dbConnection = mConnection->get_connection_ptr();
+        while(PGresult* copyResult = PQgetResult(dbConnection))
+        {
+            if(in_status == NLQ_SUCCESS && PQresultStatus(copyResult) != ExecStatusType::PGRES_COMMAND_OK)
+            {
+                in_status = NLQ_DB_ERR;
+            }
+            PQclear(copyResult);
+        }
+        mStatus = in_status;
+        bIsFinished = true;
+    }
+
+    std::unique_ptr<PostgrePooledConnection> mConnection;
+    I32 mMaxRows;
+    I64 mMaxBytes;
+    I32 mLineCount = 0;
+    I64 mByteCount = 0;
+    I32 mStatus = NLQ_SUCCESS;
+    bool bIsFinished = false;
+};
+
+MBASE_END
+
+#endif // MBASE_NLQ_COPY_STREAM_H
@@ -0,0 +1,184 @@
+#ifndef MBASE_NLQ_CURSOR_REGISTRY_H
+#define MBASE_NLQ_CURSOR_REGISTRY_H
+
+#include <mbase/common.h>
+#include <mbase/string.h>
+#include <mbase/vector.h>
+#include <mbase/unordered_map.h>
+#include <mbase/synchronization.h>
+#include <chrono>
+#include <memory>
+#include <random>
+#include "global_state.h"
+#include "db_ops.h"
+
+MBASE_BEGIN
+
+// 128 random bits in hex, for handles that are given to clients
+inline mbase::string nlq_make_token()
+{
+    static const char hexDigits[] = "0123456789abcdef";
+    thread_local std::random_device randomDevice;
+    mbase::string outToken;
+    for(I32 i = 0; i < 4; ++i)
+    {
+        U32 randomWord = randomDevice();
+        for(I32 j = 0; j < 8; ++j)
+        {
+            outToken += hexDigits[(randomWord >> (4 * j)) & 0xF];
+        }
+    }
+    return outToken;
+}
+
+// An open cursor together with the pooled connection whose transaction it lives in
+class PsqlCursor {
+public:
+    using clock_type = std::chrono::steady_clock;
+
+    PsqlCursor(std::unique_ptr<PostgrePooledConnection>&& in_connection, I32 in_page_size, I32 in_result_format, const nlq_output_options& in_options) :
+        mConnection(std::move(in_connection)),
+        mPageSize(in_page_size),
+        mResultFormat(in_result_format),
+        mOptions(in_options),
+        mLastUsed(clock_type::now())
+    {
+    }
+
+    ~PsqlCursor()
+    {
+        psql_close_cursor(mConnection->get_connection_ptr());
+    }
+
+    PsqlCursor(const PsqlCursor&) = delete;
+    PsqlCursor& operator=(const PsqlCursor&) = delete;
+
+    bool fetch_page(PsqlResultBuffer& out_rows, I32& out_status)
+    {
+        return psql_fetch_page(mConnection->get_connection_ptr(), mPageSize, mResultFormat, out_rows, out_status);
+    }
+
+    I32 get_page_size() const
+    {
+        return mPageSize;
+    }
+
+    const nlq_output_options& get_options() const
+    {
+        return mOptions;
+    }
+
+private:
+    friend class PsqlCursorRegistry;
+
+    std::unique_ptr<PostgrePooledConnection> mConnection;
+    I32 mPageSize;
+    I32 mResultFormat;
+    nlq_output_options mOptions;
+    clock_type::time_point mLastUsed;
+    bool bIsBusy = false;
+};
+
+/*
+    Open cursors by continuation token.
+    A cursor is used by one request at a time; the maintenance thread closes the ones that are
+    idle for longer than gCursorIdleTimeout seconds. Every open cursor holds a pooled connection.
+*/
+class PsqlCursorRegistry {
+public:
+    // Reserves room for a cursor before the generation starts, so that a full registry doesn't waste the inference
+    bool reserve()
+    {
+        mbase::lock_guard lockGuard(mRegistrySync);
+        if((I32)mCursors.size() + mReservedCount >= gCursorMaxOpen)
+        {
+            return false;
+        }
+        ++mReservedCount;
+        return true;
+    }
+
+    GENERIC unreserve()
+    {
+        mbase::lock_guard lockGuard(mRegistrySync);
+        --mReservedCount;
+    }
+
+    // Takes the place of an earlier reservation, returns the continuation token
+    mbase::string register_cursor(const std::shared_ptr<PsqlCursor>& in_cursor)
+    {
+        mbase::string cursorToken = nlq_make_token();
+        mbase::lock_guard lockGuard(mRegistrySync);
+        --mReservedCount;
+        mCursors[cursorToken] = in_cursor;
+        return cursorToken;
+    }
+
+    // Null if the token is unknown, reaped or in use by another request
+    std::shared_ptr<PsqlCursor> acquire(const mbase::string& in_token)
+    {
+        mbase::lock_guard lockGuard(mRegistrySync);
+        auto It = mCursors.find(in_token);
+        if(It == mCursors.end() || It->second->bIsBusy)
+        {
+            return nullptr;
+        }
+        It->second->bIsBusy = true;
+        return It->second;
+    }
+
+    // Exhausted or failed cursors are dropped, their transaction is closed once the last reference goes away
+    GENERIC release(const mbase::string& in_token, bool in_is_finished)
+    {
+        std::shared_ptr<PsqlCursor> finishedCursor; // outlives the lock, so the transaction is never closed while holding it
+        mbase::lock_guard lockGuard(mRegistrySync);
+        auto It = mCursors.find(in_token);
+        if(It == mCursors.end())
+        {
+            return;
+        }
+
+        if(in_is_finished)
+        {
+            finishedCursor = It->second;
+            mCursors.erase(It);
+            return;
+        }
+        It->second->bIsBusy = false;
+        It->second->mLastUsed = PsqlCursor::clock_type::now();
+    }
+
+    GENERIC reap_idle()
+    {
+        mbase::vector<std::shared_ptr<PsqlCursor>> reapedCursors;
+        PsqlCursor::clock_type::time_point timeNow = PsqlCursor::clock_type::now();
+        {
+            mbase::lock_guard lockGuard(mRegistrySync);
+            for(auto It = mCursors.begin(); It != mCursors.end();)
+            {
+                I64 idleSeconds = std::chrono::duration_cast<std::chrono::seconds>(timeNow - It->second->mLastUsed).count();
+                if(!It->second->bIsBusy && idleSeconds >= gCursorIdleTimeout)
+                {
+                    reapedCursors.push_back(It->second);
+                    It = mCursors.erase(It);
+                }
+                else
+                {
+                    ++It;
+                }
+            }
+        }
+        // cursors are closed here, outside of the lock
+    }
+
+private:
+    mbase::mutex mRegistrySync;
+    mbase::unordered_map<mbase::string, std::shared_ptr<PsqlCursor>> mCursors;
+    I32 mReservedCount = 0;
+};
+
+inline PsqlCursorRegistry gPsqlCursorRegistry;
+
+MBASE_END
+
+#endif // MBASE_NLQ_CURSOR_REGISTRY_H
@@ -0,0 +1,574 @@
+#ifndef MBASE_NLQ_DB_DECODE_H
+#define MBASE_NLQ_DB_DECODE_H
+
+#include <mbase/common.h>
+#include <mbase/string.h>
+#include <mbase/vector.h>
+#include <libpq-fe.h>
+#include <cstring>
+#include <cstdio>
+#include <string>
+#include "json_writer.h"
+
+MBASE_BEGIN
+
+// Built-in type OIDs, see pg_type.dat
+#define NLQ_PSQL_OID_BOOL 16
+#define NLQ_PSQL_OID_CHAR 18
+#define NLQ_PSQL_OID_NAME 19
+#define NLQ_PSQL_OID_INT8 20
+#define NLQ_PSQL_OID_INT2 21
+#define NLQ_PSQL_OID_INT4 23
+#define NLQ_PSQL_OID_TEXT 25
+#define NLQ_PSQL_OID_OID 26
+#define NLQ_PSQL_OID_JSON 114
+#define NLQ_PSQL_OID_FLOAT4 700
+#define NLQ_PSQL_OID_FLOAT8 701
+#define NLQ_PSQL_OID_BPCHAR 1042
+#define NLQ_PSQL_OID_VARCHAR 1043
+#define NLQ_PSQL_OID_DATE 1082
+#define NLQ_PSQL_OID_TIMESTAMP 1114
+#define NLQ_PSQL_OID_TIMESTAMPTZ 1184
+#define NLQ_PSQL_OID_NUMERIC 1700
+#define NLQ_PSQL_OID_UUID 2950
+#define NLQ_PSQL_OID_JSONB 3802
+
+enum class psql_value_kind : U8 {
+    INTEGER,
+    FLOAT,
+    NUMERIC,
+    BOOL,
+    DATE,
+    TIMESTAMP,
+    TIMESTAMPTZ,
+    UUID,
+    JSONB,
+    TEXT // text like types and everything that is decoded from the text format as is
+};
+
+struct psql_column_decoder {
+    mbase::string mName;
+    Oid mType = 0;
+    I32 mColumnIndex = 0;
+    psql_value_kind mKind = psql_value_kind::TEXT;
+    bool bIsBinary = false;
+};
+
+// Types whose binary representation can be decoded here. A result is only fetched in binary if all of its columns are in this list.
+inline bool psql_is_binary_decodable(Oid in_type)
+{
+    switch(in_type)
+    {
+    case NLQ_PSQL_OID_BOOL:
+    case NLQ_PSQL_OID_CHAR:
+    case NLQ_PSQL_OID_NAME:
+    case NLQ_PSQL_OID_INT8:
+    case NLQ_PSQL_OID_INT2:
+    case NLQ_PSQL_OID_INT4:
+    case NLQ_PSQL_OID_TEXT:
+    case NLQ_PSQL_OID_OID:
+    case NLQ_PSQL_OID_JSON:
+    case NLQ_PSQL_OID_FLOAT4:
+    case NLQ_PSQL_OID_FLOAT8:
+    case NLQ_PSQL_OID_BPCHAR:
+    case NLQ_PSQL_OID_VARCHAR:
+    case NLQ_PSQL_OID_DATE:
+    case NLQ_PSQL_OID_TIMESTAMP:
+    case NLQ_PSQL_OID_NUMERIC:
+    case NLQ_PSQL_OID_UUID:
+    case NLQ_PSQL_OID_JSONB:
+        return true;
+    case NLQ_PSQL_OID_TIMESTAMPTZ:
+        // binary timestamptz is always UTC, the text format follows the TimeZone of the session like psql does
+        return false;
+    default:
+        return false;
+    }
+}
+
+inline psql_value_kind psql_kind_from_oid(Oid in_type)
+{
+    switch(in_type)
+    {
+    case NLQ_PSQL_OID_INT2:
+    case NLQ_PSQL_OID_INT4:
+    case NLQ_PSQL_OID_INT8:
+    case NLQ_PSQL_OID_OID:
+        return psql_value_kind::INTEGER;
+    case NLQ_PSQL_OID_FLOAT4:
+    case NLQ_PSQL_OID_FLOAT8:
+        return psql_value_kind::FLOAT;
+    case NLQ_PSQL_OID_NUMERIC:
+        return psql_value_kind::NUMERIC;
+    case NLQ_PSQL_OID_BOOL:
+        return psql_value_kind::BOOL;
+    case NLQ_PSQL_OID_DATE:
+        return psql_value_kind::DATE;
+    case NLQ_PSQL_OID_TIMESTAMP:
+        return psql_value_kind::TIMESTAMP;
+    case NLQ_PSQL_OID_TIMESTAMPTZ:
+        return psql_value_kind::TIMESTAMPTZ;
+    case NLQ_PSQL_OID_UUID:
+        return psql_value_kind::UUID;
+    case NLQ_PSQL_OID_JSONB:
+        return psql_value_kind::JSONB;
+    default:
+        return psql_value_kind::TEXT;
+    }
+}
+
+// Resolves one decoder per column once, before the row loop
+inline GENERIC psql_resolve_decoders(const PGresult* in_result, mbase::vector<psql_column_decoder>& out_decoders)
+{
+    out_decoders.clear();
+    for(I32 i = 0; i < PQnfields(in_result); ++i)
+    {
+        psql_column_decoder columnDecoder;
+        columnDecoder.mName = PQfname(in_result, i);
+        columnDecoder.mType = PQftype(in_result, i);
+        columnDecoder.mColumnIndex = i;
+        columnDecoder.mKind = psql_kind_from_oid(columnDecoder.mType);
+        columnDecoder.bIsBinary = PQfformat(in_result, i) == 1;
+        out_decoders.push_back(columnDecoder);
+    }
+}
+
+inline U16 psql_read_u16(const char* in_data)
+{
+    const U8* rawBytes = reinterpret_cast<const U8*>(in_data);
+    return (U16)((rawBytes[0] << 8) | rawBytes[1]);
+}
+
+inline U32 psql_read_u32(const char* in_data)
+{
+    const U8* rawBytes = reinterpret_cast<const U8*>(in_data);
+    return ((U32)rawBytes[0] << 24) | ((U32)rawBytes[1] << 16) | ((U32)rawBytes[2] << 8) | (U32)rawBytes[3];
+}
+
+inline U64 psql_read_u64(const char* in_data)
+{
+    return ((U64)psql_read_u32(in_data) << 32) | psql_read_u32(in_data + 4);
+}
+
+inline I64 psql_decode_binary_integer(const char* in_data, I32 in_length, Oid in_type)
+{
+    if(in_length == 2)
+    {
+        return (I16)psql_read_u16(in_data);
+    }
+
+    else if(in_length == 4)
+    {
+        // oid is unsigned
+        return in_type == NLQ_PSQL_OID_OID ? (I64)psql_read_u32(in_data) : (I64)(I32)psql_read_u32(in_data);
+    }
+    return (I64)psql_read_u64(in_data);
+}
+
+inline F64 psql_decode_binary_float(const char* in_data, I32 in_length)
+{
+    if(in_length == 4)
+    {
+        U32 rawBits = psql_read_u32(in_data);
+        F32 outValue;
+        memcpy(&outValue, &rawBits, sizeof(outValue));
+        return outValue;
+    }
+    U64 rawBits = psql_read_u64(in_data);
+    F64 outValue;
+    memcpy(&outValue, &rawBits, sizeof(outValue));
+    return outValue;
+}
+
+/*
+    Binary numeric is a sequence of base 10000 digits with a weight (exponent of the first digit)
+    and a display scale. The digits are appended to out_decimal as a plain decimal, which is a valid JSON number.
+    Returns false for NaN and infinities without touching out_decimal, out_special then holds their text form.
+*/
+inline bool psql_decode_binary_numeric(const char* in_data, I32 in_length, std::string& out_decimal, const char*& out_special)
+{
+    out_special = "NaN";
+    if(in_length < 8)
+    {
+        return false;
+    }
+
+    I16 digitCount = (I16)psql_read_u16(in_data);
+    I16 digitWeight = (I16)psql_read_u16(in_data + 2);
+    U16 numericSign = psql_read_u16(in_data + 4);
+    I16 displayScale = (I16)psql_read_u16(in_data + 6);
+
+    if(numericSign != 0x0000 && numericSign != 0x4000)
+    {
+        out_special = numericSign == 0xD000 ? "Infinity" : (numericSign == 0xF000 ? "-Infinity" : "NaN");
+        return false;
+    }
+
+    if(in_length < 8 + digitCount * 2)
+    {
+        return false;
+    }
+
+    auto digitAt = [&](I32 in_index) -> I32 {
+        if(in_index < 0 || in_index >= digitCount)
+        {
+            return 0;
+        }
+        return (I16)psql_read_u16(in_data + 8 + in_index * 2);
+    };
+
+    char groupBuffer[8];
+    if(numericSign == 0x4000)
+    {
+        out_decimal += '-';
+    }
+
+    if(digitWeight < 0)
+    {
+        out_decimal += '0';
+    }
+    else
+    {
+        for(I32 i = 0; i <= digitWeight; ++i)
+        {
+            I32 groupLength = snprintf(groupBuffer, sizeof(groupBuffer), i ? "%04d" : "%d", digitAt(i));
+            out_decimal.append(groupBuffer, groupLength);
+        }
+    }
+
+    if(displayScale > 0)
+    {
+        out_decimal += '.';
+        I32 writtenScale = 0;
+        for(I32 i = digitWeight + 1; writtenScale < displayScale; ++i)
+        {
+            snprintf(groupBuffer, sizeof(groupBuffer), "%04d", digitAt(i));
+            for(I32 k = 0; k < 4 && writtenScale < displayScale; ++k, ++writtenScale)
+            {
+                out_decimal += groupBuffer[k];
+            }
+        }
+    }
+    return true;
+}
+
+// Days since 1970-01-01 to a civil date
+inline GENERIC psql_civil_from_days(I64 in_days, I64& out_year, I32& out_month, I32& out_day)
+{
+    in_days += 719468;
+    I64 dayEra = (in_days >= 0 ? in_days : in_days - 146096) / 146097;
+    I64 dayOfEra = in_days - dayEra * 146097;
+    I64 yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+    I64 dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+    I64 monthPortion = (5 * dayOfYear + 2) / 153;
+    out_day = (I32)(dayOfYear - (153 * monthPortion + 2) / 5 + 1);
+    out_month = (I32)(monthPortion < 10 ? monthPortion + 3 : monthPortion - 9);
+    out_year = yearOfEra + dayEra * 400 + (out_month <= 2);
+}
+
+// Civil date to days since 1970-01-01
+inline I64 psql_days_from_civil(I64 in_year, I32 in_month, I32 in_day)
+{
+    in_year -= in_month <= 2;
+    I64 dayEra = (in_year >= 0 ? in_year : in_year - 399) / 400;
+    I64 yearOfEra = in_year - dayEra * 400;
+    I64 dayOfYear = (153 * (in_month > 2 ? in_month - 3 : in_month + 9) + 2) / 5 + in_day - 1;
+    I64 dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    return dayEra * 146097 + dayOfEra - 719468;
+}
+
+#define NLQ_PSQL_EPOCH_DAY_OFFSET 10957 // days between 1970-01-01 and the PostgreSQL epoch 2000-01-01
+#define NLQ_PSQL_FORMAT_BUFFER_SIZE 64
+
+// The format functions write into a caller supplied buffer of NLQ_PSQL_FORMAT_BUFFER_SIZE bytes and return the length
+
+inline I32 psql_format_date(I32 in_pg_days, char* out_buffer)
+{
+    if(in_pg_days == 0x7FFFFFFF)
+    {
+        return snprintf(out_buffer, NLQ_PSQL_FORMAT_BUFFER_SIZE, "infinity");
+    }
+
+    if(in_pg_days == (I32)0x80000000)
+    {
+        return snprintf(out_buffer, NLQ_PSQL_FORMAT_BUFFER_SIZE, "-infinity");
+    }
+    I64 dateYear = 0;
+    I32 dateMonth = 0;
+    I32 dateDay = 0;
+    psql_civil_from_days((I64)in_pg_days + NLQ_PSQL_EPOCH_DAY_OFFSET, dateYear, dateMonth, dateDay);
+    return snprintf(out_buffer, NLQ_PSQL_FORMAT_BUFFER_SIZE, "%04lld-%02d-%02d", (long long)dateYear, dateMonth, dateDay);
+}
+
+inline I32 psql_format_timestamp(I64 in_pg_micros, bool in_with_zone, char* out_buffer)
+{
+    if(in_pg_micros == INT64_MAX)
+    {
+        return snprintf(out_buffer, NLQ_PSQL_FORMAT_BUFFER_SIZE, "infinity");
+    }
+
+    if(in_pg_micros == INT64_MIN)
+    {
+        return snprintf(out_buffer, NLQ_PSQL_FORMAT_BUFFER_SIZE, "-infinity");
+    }
+
+    const I64 microsPerDay = 86400000000LL;
+    I64 dayCount = in_pg_micros / microsPerDay;
+    I64 dayMicros = in_pg_micros % microsPerDay;
+    if(dayMicros < 0)
+    {
+        dayMicros += microsPerDay;
+        dayCount--;
+    }
+
+    I32 outLength = psql_format_date((I32)dayCount, out_buffer);
+    I64 secondsOfDay = dayMicros / 1000000;
+    I64 fractionMicros = dayMicros % 1000000;
+    outLength += snprintf(out_buffer + outLength, NLQ_PSQL_FORMAT_BUFFER_SIZE - outLength, " %02d:%02d:%02d", (I32)(secondsOfDay / 3600), (I32)(secondsOfDay / 60 % 60), (I32)(secondsOfDay % 60));
+    if(fractionMicros)
+    {
+        outLength += snprintf(out_buffer + outLength, NLQ_PSQL_FORMAT_BUFFER_SIZE - outLength, ".%06d", (I32)fractionMicros);
+        while(out_buffer[outLength - 1] == '0')
+        {
+            outLength--;
+        }
+    }
+
+    if(in_with_zone)
+    {
+        // binary timestamptz is always UTC; it isn't requested in binary (psql_is_binary_decodable), this is for completeness
+        outLength += snprintf(out_buffer + outLength, NLQ_PSQL_FORMAT_BUFFER_SIZE - outLength, "+00");
+    }
+    return outLength;
+}
+
+inline I32 psql_format_uuid(const char* in_data, char* out_buffer)
+{
+    static const char hexDigits[] = "0123456789abcdef";
+    const U8* rawBytes = reinterpret_cast<const U8*>(in_data);
+    I32 outLength = 0;
+    for(I32 i = 0; i < 16; ++i)
+    {
+        if(i == 4 || i == 6 || i == 8 || i == 10)
+        {
+            out_buffer[outLength++] = '-';
+        }
+        out_buffer[outLength++] = hexDigits[rawBytes[i] >> 4];
+        out_buffer[outLength++] = hexDigits[rawBytes[i] & 0xF];
+    }
+    return outLength;
+}
+
+/*
+    Parsers for the ISO DateStyle text output, used when a result couldn't be fetched in binary.
+    They return false for anything else (infinity, BC dates, other date styles).
+*/
+inline bool psql_parse_text_date(const char* in_text, I64& out_unix_days, const char** out_end = nullptr)
+{
+    I32 dateYear = 0;
+    I32 dateMonth = 0;
+    I32 dateDay = 0;
+    I32 consumedLength = 0;
+    if(sscanf(in_text, "%d-%d-%d%n", &dateYear, &dateMonth, &dateDay, &consumedLength) != 3 || strstr(in_text, " BC"))
+    {
+        return false;
+    }
+    out_unix_days = psql_days_from_civil(dateYear, dateMonth, dateDay);
+    if(out_end)
+    {
+        *out_end = in_text + consumedLength;
+    }
+    return true;
+}
+
+inline bool psql_parse_text_timestamp(const char* in_text, I64& out_unix_micros)
+{
+    I64 unixDays = 0;
+    const char* timePart = nullptr;
+    if(!psql_parse_text_date(in_text, unixDays, &timePart))
+    {
+        return false;
+    }
+
+    I32 timeHour = 0;
+    I32 timeMinute = 0;
+    I32 timeSecond = 0;
+    I32 consumedLength = 0;
+    if(sscanf(timePart, " %d:%d:%d%n", &timeHour, &timeMinute, &timeSecond, &consumedLength) != 3)
+    {
+        return false;
+    }
+    timePart += consumedLength;
+
+    I64 fractionMicros = 0;
+    if(*timePart == '.')
+    {
+        I64 fractionScale = 100000;
+        for(++timePart; *timePart >= '0' && *timePart <= '9'; ++timePart)
+        {
+            fractionMicros += (*timePart - '0') * fractionScale;
+            fractionScale /= 10;
+        }
+    }
+
+    I64 zoneSeconds = 0;
+    if(*timePart == '+' || *timePart == '-')
+    {
+        I32 zoneSign = *timePart == '-' ? -1 : 1;
+        I32 zoneHour = 0;
+        I32 zoneMinute = 0;
+        I32 zoneSecond = 0;
+        sscanf(timePart + 1, "%d:%d:%d", &zoneHour, &zoneMinute, &zoneSecond);
+        zoneSeconds = zoneSign * (zoneHour * 3600 + zoneMinute * 60 + zoneSecond);
+    }
+    out_unix_micros = (unixDays * 86400 + timeHour * 3600 + timeMinute * 60 + timeSecond - zoneSeconds) * 1000000 + fractionMicros;
+    return true;
+}
+
+inline bool psql_is_special_float_text(const char* in_text)
+{
+    return !strcmp(in_text, "NaN") || strstr(in_text, "Infinity") != nullptr;
+}
+
+// Writes the cell as a JSON value, straight from the libpq buffer
+inline GENERIC psql_write_json_cell(const psql_column_decoder& in_decoder, const PGresult* in_result, I32 in_row, std::string& out_json)
+{
+    if(PQgetisnull(in_result, in_row, in_decoder.mColumnIndex))
+    {
+        out_json += "null";
+        return;
+    }
+
+    const char* cellData = PQgetvalue(in_result, in_row, in_decoder.mColumnIndex);
+    I32 cellLength = PQgetlength(in_result, in_row, in_decoder.mColumnIndex);
+    char formatBuffer[NLQ_PSQL_FORMAT_BUFFER_SIZE];
+
+    if(!in_decoder.bIsBinary)
+    {
+        // text format, the column type still tells us what the value is
+        switch(in_decoder.mKind)
+        {
+        case psql_value_kind::INTEGER:
+            out_json.append(cellData, cellLength);
+            return;
+        case psql_value_kind::FLOAT:
+        case psql_value_kind::NUMERIC:
+            if(psql_is_special_float_text(cellData))
+            {
+                json_append_string(out_json, cellData, cellLength);
+                return;
+            }
+            out_json.append(cellData, cellLength);
+            return;
+        case psql_value_kind::BOOL:
+            out_json += cellData[0] == 't' ? "true" : "false";
+            return;
+        default:
+            json_append_string(out_json, cellData, cellLength);
+            return;
+        }
+    }
+
+    switch(in_decoder.mKind)
+    {
+    case psql_value_kind::INTEGER:
+        json_append_i64(out_json, psql_decode_binary_integer(cellData, cellLength, in_decoder.mType));
+        return;
+    case psql_value_kind::FLOAT:
+        json_append_f64(out_json, psql_decode_binary_float(cellData, cellLength));
+        return;
+    case psql_value_kind::NUMERIC:
+    {
+        const char* specialValue = nullptr;
+        if(!psql_decode_binary_numeric(cellData, cellLength, out_json, specialValue))
+        {
+            json_append_string(out_json, specialValue, strlen(specialValue));
+        }
+        return;
+    }
+    case psql_value_kind::BOOL:
+        out_json += cellData[0] ? "true" : "false";
+        return;
+    case psql_value_kind::DATE:
+        json_append_string(out_json, formatBuffer, psql_format_date((I32)psql_read_u32(cellData), formatBuffer));
+        return;
+    case psql_value_kind::TIMESTAMP:
+    case psql_value_kind::TIMESTAMPTZ:
+        json_append_string(out_json, formatBuffer, psql_format_timestamp((I64)psql_read_u64(cellData), in_decoder.mKind == psql_value_kind::TIMESTAMPTZ, formatBuffer));
+        return;
+    case psql_value_kind::UUID:
+        json_append_string(out_json, formatBuffer, psql_format_uuid(cellData, formatBuffer));
+        return;
+    case psql_value_kind::JSONB:
+        // the first byte is the jsonb format version
+        json_append_string(out_json, cellData + 1, cellLength ? cellLength - 1 : 0);
+        return;
+    default:
+        json_append_string(out_json, cellData, cellLength);
+        return;
+    }
+}
+
+// Appends the text form of a non-null cell, the same text PostgreSQL would send in the text format for text like types
+inline GENERIC psql_append_cell_text(const psql_column_decoder& in_decoder, const PGresult* in_result, I32 in_row, std::string& out_text)
+{
+    const char* cellData = PQgetvalue(in_result, in_row, in_decoder.mColumnIndex);
+    I32 cellLength = PQgetlength(in_result, in_row, in_decoder.mColumnIndex);
+    char formatBuffer[NLQ_PSQL_FORMAT_BUFFER_SIZE];
+
+    if(!in_decoder.bIsBinary)
+    {
+        out_text.append(cellData, cellLength);
+        return;
+    }
+
+    switch(in_decoder.mKind)
+    {
+    case psql_value_kind::INTEGER:
+        json_append_i64(out_text, psql_decode_binary_integer(cellData, cellLength, in_decoder.mType));
+        return;
+    case psql_value_kind::FLOAT:
+    {
+        F64 floatValue = psql_decode_binary_float(cellData, cellLength);
+        if(floatValue != floatValue || floatValue - floatValue != 0)
+        {
+            out_text += floatValue != floatValue ? "NaN" : floatValue > 0 ? "Infinity" : "-Infinity";
+            return;
+        }
+        json_append_f64(out_text, floatValue);
+        return;
+    }
+    case psql_value_kind::NUMERIC:
+    {
+        const char* specialValue = nullptr;
+        if(!psql_decode_binary_numeric(cellData, cellLength, out_text, specialValue))
+        {
+            out_text += specialValue;
+        }
+        return;
+    }
+    case psql_value_kind::BOOL:
+        out_text += cellData[0] ? 't' : 'f';
+        return;
+    case psql_value_kind::DATE:
+        out_text.append(formatBuffer, psql_format_date((I32)psql_read_u32(cellData), formatBuffer));
+        return;
+    case psql_value_kind::TIMESTAMP:
+    case psql_value_kind::TIMESTAMPTZ:
+        out_text.append(formatBuffer, psql_format_timestamp((I64)psql_read_u64(cellData), in_decoder.mKind == psql_value_kind::TIMESTAMPTZ, formatBuffer));
+        return;
+    case psql_value_kind::UUID:
+        out_text.append(formatBuffer, psql_format_uuid(cellData, formatBuffer));
+        return;
+    case psql_value_kind::JSONB:
+        out_text.append(cellData + 1, cellLength ? cellLength - 1 : 0);
+        return;
+    default:
+        out_text.append(cellData, cellLength);
+        return;
+    }
+}
+
+MBASE_END
+
+#endif // MBASE_NLQ_DB_DECODE_H
@@ -4,8 +4,18 @@
 #include <mbase/common.h>
 #include <mbase/string.h>
 #include <libpq-fe.h>
+#include <string_view>
+#include <cstdlib>
+#include <cstring>
+#include <memory_resource>
 #include "model_proc_cl.h"
+#include "db_pool.h"
+#include "sql_rewrite.h"
+#include "db_decode.h"
+#include "result_writer.h"
+#include "arrow_writer.h"
 #include "nlq_status.h"
+#include "schema_snapshot.h"
 
 MBASE_BEGIN
 
@@ -19,7 +29,7 @@ public:
         const mbase::string& in_password
     )
     {
-        mbase::string outputFormat = mbase::string::from_format("host=%s port=%d dbname=%s user=%s password=%s connect_timeout=2 sslmode=allow", in_hostname.c_str(), in_port, in_dbname.c_str(), in_username.c_str(), in_password.c_str());
+        mbase::string outputFormat = psql_make_conninfo(in_hostname, in_port, in_dbname, in_username, in_password);
         mPostgreConnection = PQconnectdb(outputFormat.c_str());
 
         if(PQstatus(mPostgreConnection) == ConnStatusType::CONNECTION_BAD)
@@ -59,14 +69,27 @@ private:
     bool bIsConnected = false;
 };
 
+// Sections are assembled in the request arena, only the final prompt is allocated as a mbase::string
 mbase::string prepare_nlquery_prompt(
-    const mbase::string& in_sql_history,
-    const mbase::string& in_nlquery
+    std::string_view in_sql_history,
+    std::string_view in_nlquery,
+    std::pmr::memory_resource* in_arena
 )
 {
-    mbase::string sqlHistorySection = "<SQL_HISTORY_BEGIN>\n" + in_sql_history + "\n<SQL_HISTORY_END>\n";
-    mbase::string nlQuerySection = "<NLQUERY_BEGIN>\n" + in_nlquery + "\n<NLQUERY_END>\n";
-    return sqlHistorySection + nlQuerySection;
+    static const std::string_view historyBegin = "<SQL_HISTORY_BEGIN>\n";
+    static const std::string_view historyEnd = "\n<SQL_HISTORY_END>\n";
+    static const std::string_view nlQueryBegin = "<NLQUERY_BEGIN>\n";
+    static const std::string_view nlQueryEnd = "\n<NLQUERY_END>\n";
+
+    std::pmr::string promptString(in_arena);
+    promptString.reserve(historyBegin.size() + in_sql_history.size() + historyEnd.size() + nlQueryBegin.size() + in_nlquery.size() + nlQueryEnd.size());
+    promptString += historyBegin;
+    promptString += in_sql_history;
+    promptString += historyEnd;
+    promptString += nlQueryBegin;
+    promptString += in_nlquery;
+    promptString += nlQueryEnd;
+    return mbase::string(promptString.data(), promptString.size());
 }
 
 mbase::string prepare_semantic_correction_prompt(
@@ -79,182 +102,533 @@ mbase::string prepare_semantic_correction_prompt(
     return sqlHistorySection + correctionSection;
 }
 
-GENERIC build_table_metadata(const mbase::string& in_schema_name, const mbase::string& in_table_name, mbase::vector<mbase::Json>& in_meta_vector)
+// Follow up turn of a repair, the failed statement is the previous assistant turn
+mbase::string prepare_repair_prompt(const mbase::string& in_error_message)
+{
+    return "PostgreSQL rejected the query above with the following error. Respond with the corrected query only.\n" + in_error_message;
+}
+
+GENERIC build_table_metadata(nlq_database& io_database, const mbase::string& in_schema_name, const mbase::string& in_table_name, const mbase::vector<table_relation_meta>& in_relations)
 {
     mbase::string tableMetaTotalString = in_table_name + '=';
-    for(mbase::Json& metaItem : in_meta_vector)
+    mbase::vector<table_relation_meta>& cachedRelations = io_database.mCachedTableRelations[in_table_name];
+    for(const table_relation_meta& trm : in_relations)
     {
-        table_relation_meta trm;
-        mbase::string constType = "null";
-        mbase::string refColumn = "null";
-        mbase::string refTable = "null";
+        cachedRelations.push_back(trm);
+        tableMetaTotalString += trm.columnName + ';' + trm.columnDataType + ';' + trm.referenceTable + ',';
+    }
+    tableMetaTotalString.pop_back(); // remove the last comma
+    tableMetaTotalString += '\n';
+    io_database.mSchemaTableMap[in_schema_name] += tableMetaTotalString;
+}
 
-        if(metaItem["constraint_type"].isString())
+// Array literal for a text[] parameter, every element is quoted
+mbase::string psql_make_text_array(const mbase::set<mbase::string>& in_values)
+{
+    mbase::string arrayLiteral = "{";
+    for(const mbase::string& arrayValue : in_values)
+    {
+        arrayLiteral += '"';
+        for(char valueChar : arrayValue)
         {
-            constType = metaItem["constraint_type"].getString();
+            if(valueChar == '"' || valueChar == '\\')
+            {
+                arrayLiteral += '\\';
+            }
+            arrayLiteral += valueChar;
         }
+        arrayLiteral += "\",";
+    }
+    if(arrayLiteral.size() > 1)
+    {
+        arrayLiteral.pop_back();
+    }
+    arrayLiteral += '}';
+    return arrayLiteral;
+}
+
+#define MBASE_NLQ_PSQL_CHUNK_ROWS 256
+
+#ifdef LIBPQ_HAS_CHUNK_MODE
+#define MBASE_NLQ_PSQL_TUPLES_CHUNK ExecStatusType::PGRES_TUPLES_CHUNK
+#else
+#define MBASE_NLQ_PSQL_TUPLES_CHUNK ExecStatusType::PGRES_SINGLE_TUPLE
+#endif
+
+// Schemas the introspection looks at: the given ones, or all non-system schemas if $1 is NULL
+#define MBASE_NLQ_PSQL_NAMESPACE_FILTER \
+    "CASE WHEN $1::text[] IS NULL " \
+        "THEN n.nspname NOT IN ('information_schema', 'pg_catalog', 'pg_toast') AND n.nspname NOT LIKE 'pg\\_temp\\_%' AND n.nspname NOT LIKE 'pg\\_toast\\_temp\\_%' " \
+        "ELSE n.nspname = ANY($1::text[]) END "
+
+/*
+    Columns of every visible table in the given schemas (all non-system schemas if $1 is NULL),
+    one row per column and key constraint it is part of, ordered so that the rows of a table are adjacent.
+    The visibility check is the one information_schema.tables does.
+*/
+#define MBASE_NLQ_PSQL_INTROSPECT_QUERY \
+    "SELECT n.nspname, c.relname, a.attname, pg_catalog.format_type(a.atttypid, -1), " \
+    "CASE con.contype WHEN 'p' THEN 'PRIMARY KEY' WHEN 'f' THEN 'FOREIGN KEY' WHEN 'u' THEN 'UNIQUE' END, " \
+    "rc.relname, ra.attname " \
+    "FROM pg_catalog.pg_class c " \
+    "JOIN pg_catalog.pg_namespace n ON n.oid = c.relnamespace " \
+    "JOIN pg_catalog.pg_attribute a ON a.attrelid = c.oid AND a.attnum > 0 AND NOT a.attisdropped " \
+    "LEFT JOIN pg_catalog.pg_constraint con ON con.conrelid = c.oid AND con.contype IN ('p', 'f', 'u') AND a.attnum = ANY(con.conkey) " \
+    "LEFT JOIN pg_catalog.pg_class rc ON con.contype = 'f' AND rc.oid = con.confrelid " \
+    "LEFT JOIN pg_catalog.pg_attribute ra ON con.contype = 'f' AND ra.attrelid = con.confrelid AND ra.attnum = con.confkey[pg_catalog.array_position(con.conkey, a.attnum)] " \
+    "WHERE c.relkind IN ('r', 'p') " \
+    "AND " MBASE_NLQ_PSQL_NAMESPACE_FILTER \
+    "AND (pg_catalog.pg_has_role(c.relowner, 'USAGE') " \
+        "OR pg_catalog.has_table_privilege(c.oid, 'SELECT, INSERT, UPDATE, DELETE, TRUNCATE, REFERENCES, TRIGGER') " \
+        "OR pg_catalog.has_any_column_privilege(c.oid, 'SELECT, INSERT, UPDATE, REFERENCES')) " \
+    "ORDER BY n.nspname, c.relname, a.attnum, con.conname"
+
+// Fills the schema from the metadata snapshot if its fingerprint matches the live catalog
+bool psql_load_schema_snapshot(nlq_database& io_database, const mbase::string& in_fingerprint)
+{
+    NlqSchemaSnapshot schemaSnapshot;
+    if(!schemaSnapshot.open(nlq_snapshot_path(io_database.mName)) || schemaSnapshot.get_fingerprint() != std::string_view(in_fingerprint.c_str(), in_fingerprint.size()))
+    {
+        return false;
+    }
 
-        if(metaItem["referenced_table"].isString())
+    for(U32 i = 0; i < schemaSnapshot.get_table_count(); ++i)
+    {
+        const nlq_snapshot_table& snapshotTable = schemaSnapshot.get_table(i);
+        mbase::vector<table_relation_meta> tableRelations;
+        for(U32 j = snapshotTable.mFirstRelation; j < snapshotTable.mFirstRelation + snapshotTable.mRelationCount; ++j)
         {
-            refTable = metaItem["referenced_table"].getString();
+            const nlq_snapshot_relation& snapshotRelation = schemaSnapshot.get_relation(j);
+            std::string_view columnName = schemaSnapshot.get_string(snapshotRelation.mColumnName);
+            std::string_view columnDataType = schemaSnapshot.get_string(snapshotRelation.mColumnDataType);
+            std::string_view constraintName = schemaSnapshot.get_string(snapshotRelation.mConstraintName);
+            std::string_view referenceTable = schemaSnapshot.get_string(snapshotRelation.mReferenceTable);
+            std::string_view referenceColumn = schemaSnapshot.get_string(snapshotRelation.mReferenceColumn);
+
+            table_relation_meta trm;
+            trm.columnName = mbase::string(columnName.data(), columnName.size());
+            trm.columnDataType = mbase::string(columnDataType.data(), columnDataType.size());
+            trm.constraintName = mbase::string(constraintName.data(), constraintName.size());
+            trm.referenceTable = mbase::string(referenceTable.data(), referenceTable.size());
+            trm.referenceColumn = mbase::string(referenceColumn.data(), referenceColumn.size());
+            tableRelations.push_back(trm);
         }
 
-        if(metaItem["referenced_column"].isString())
+        std::string_view schemaName = schemaSnapshot.get_string(snapshotTable.mSchemaName);
+        std::string_view tableName = schemaSnapshot.get_string(snapshotTable.mTableName);
+        build_table_metadata(io_database, mbase::string(schemaName.data(), schemaName.size()), mbase::string(tableName.data(), tableName.size()), tableRelations);
+    }
+    return true;
+}
+
+/*
+    Fills the schema maps of io_database, in_connection must be connected to that database.
+    in_fingerprint is the psql_get_schema_fingerprint of the catalog, the metadata snapshot is only
+    read and written if it is given. in_use_cache is false on a live refresh, the snapshot is rewritten instead.
+*/
+bool psql_get_all_tables(PGconn* in_connection, nlq_database& io_database, const mbase::string& in_fingerprint, bool in_use_cache = true)
+{
+    bool isSnapshotEnabled = gEnableDbMetafile && in_fingerprint.size();
+    if(isSnapshotEnabled && in_use_cache && psql_load_schema_snapshot(io_database, in_fingerprint))
+    {
+        printf("INFO: Reading from cached schema information!\n");
+        return true;
+    }
+
+    // a single round trip for all schemas, rows are parsed as they arrive
+    mbase::string schemaArray = psql_make_text_array(gProvidedSchemas);
+    const char* paramValues[1] = { gProvidedSchemas.size() ? schemaArray.c_str() : nullptr };
+    if(!PQsendQueryParams(in_connection, MBASE_NLQ_PSQL_INTROSPECT_QUERY, 1, nullptr, paramValues, nullptr, nullptr, 0))
+    {
+        return false;
+    }
+#ifdef LIBPQ_HAS_CHUNK_MODE
+    PQsetChunkedRowsMode(in_connection, MBASE_NLQ_PSQL_CHUNK_ROWS);
+#else
+    PQsetSingleRowMode(in_connection);
+#endif
+
+    NlqSchemaSnapshotWriter snapshotWriter;
+    mbase::string schemaName;
+    mbase::string tableName;
+    mbase::vector<table_relation_meta> tableRelations;
+    auto flushTable = [&]() {
+        if(!tableRelations.size())
+        {
+            return;
+        }
+        build_table_metadata(io_database, schemaName, tableName, tableRelations);
+        if(isSnapshotEnabled)
         {
-            refColumn = metaItem["referenced_column"].getString();
+            snapshotWriter.add_table(schemaName, tableName, tableRelations);
         }
+        tableRelations.clear();
+    };
 
-        trm.columnName = metaItem["column_name"].getString();
-        trm.columnDataType = metaItem["data_type"].getString();
-        trm.constraintName = constType;
-        trm.referenceTable = refTable;
-        trm.referenceColumn = refColumn;
+    bool isFailed = false;
+    while(PGresult* resultExec = PQgetResult(in_connection))
+    {
+        ExecStatusType est = PQresultStatus(resultExec);
+        if(est != ExecStatusType::PGRES_SINGLE_TUPLE && est != MBASE_NLQ_PSQL_TUPLES_CHUNK && est != ExecStatusType::PGRES_TUPLES_OK)
+        {
+            isFailed = true;
+            PQclear(resultExec);
+            continue;
+        }
 
-        gCachedTableRelations[in_table_name].push_back(trm);
-        tableMetaTotalString += trm.columnName + ';' + trm.columnDataType + ';' + trm.referenceTable + ',';
+        int tupleCount = PQntuples(resultExec);
+        for(int i = 0; i < tupleCount; i++)
+        {
+            const char* rowSchema = PQgetvalue(resultExec, i, 0);
+            const char* rowTable = PQgetvalue(resultExec, i, 1);
+            if(tableName != rowTable || schemaName != rowSchema)
+            {
+                flushTable();
+                schemaName = rowSchema;
+                tableName = rowTable;
+            }
+
+            table_relation_meta trm;
+            trm.columnName = PQgetvalue(resultExec, i, 2);
+            trm.columnDataType = PQgetvalue(resultExec, i, 3);
+            trm.constraintName = PQgetisnull(resultExec, i, 4) ? "null" : PQgetvalue(resultExec, i, 4);
+            trm.referenceTable = PQgetisnull(resultExec, i, 5) ? "null" : PQgetvalue(resultExec, i, 5);
+            trm.referenceColumn = PQgetisnull(resultExec, i, 6) ? "null" : PQgetvalue(resultExec, i, 6);
+            tableRelations.push_back(trm);
+        }
+        PQclear(resultExec);
     }
-    tableMetaTotalString.pop_back(); // remove the last comma
-    tableMetaTotalString += '\n';
-    gSchemaTableMap[in_schema_name] += tableMetaTotalString;
+
+    if(isFailed)
+    {
+        return false;
+    }
+    flushTable();
+
+    if(isSnapshotEnabled && !snapshotWriter.write(nlq_snapshot_path(io_database.mName), in_fingerprint))
+    {
+        printf("WARN: Unable to write the schema metadata cache to %s\n", nlq_snapshot_path(io_database.mName).c_str());
+    }
+    return true;
+}
+
+/*
+    Row count and newest xmin of the pg_class, pg_attribute and pg_constraint rows of the tables in the introspected schemas.
+    Any DDL or GRANT on them writes a new catalog row version, so the signature changes without the introspection query being run.
+    It only reads those three catalogs, there is no format_type, no constraint to column join and no aggregation of the rows themselves.
+    A change that doesn't touch them (a renamed type, a new role membership) isn't noticed; a change to a table the user can't see is
+    noticed and only costs a needless refresh.
+*/
+#define MBASE_NLQ_PSQL_FINGERPRINT_QUERY \
+    "SELECT pg_catalog.md5(pg_catalog.concat_ws(',', " \
+        "(SELECT pg_catalog.count(*) || ':' || COALESCE(pg_catalog.max(c.xmin::text::bigint), 0) FROM pg_catalog.pg_class c " \
+            "JOIN pg_catalog.pg_namespace n ON n.oid = c.relnamespace " \
+            "WHERE c.relkind IN ('r', 'p') AND " MBASE_NLQ_PSQL_NAMESPACE_FILTER "), " \
+        "(SELECT pg_catalog.count(*) || ':' || COALESCE(pg_catalog.max(a.xmin::text::bigint), 0) FROM pg_catalog.pg_attribute a " \
+            "JOIN pg_catalog.pg_class c ON c.oid = a.attrelid JOIN pg_catalog.pg_namespace n ON n.oid = c.relnamespace " \
+            "WHERE a.attnum > 0 AND c.relkind IN ('r', 'p') AND " MBASE_NLQ_PSQL_NAMESPACE_FILTER "), " \
+        "(SELECT pg_catalog.count(*) || ':' || COALESCE(pg_catalog.max(con.xmin::text::bigint), 0) FROM pg_catalog.pg_constraint con " \
+            "JOIN pg_catalog.pg_class c ON c.oid = con.conrelid JOIN pg_catalog.pg_namespace n ON n.oid = c.relnamespace " \
+            "WHERE con.contype IN ('p', 'f', 'u') AND c.relkind IN ('r', 'p') AND " MBASE_NLQ_PSQL_NAMESPACE_FILTER ")))"
+
+// Cheap signature of the catalog (MBASE_NLQ_PSQL_FINGERPRINT_QUERY), the schema refresh polls it and the metadata snapshot is keyed by it
+bool psql_get_schema_fingerprint(PGconn* in_connection, mbase::string& out_fingerprint)
+{
+    mbase::string schemaArray = psql_make_text_array(gProvidedSchemas);
+    const char* paramValues[1] = { gProvidedSchemas.size() ? schemaArray.c_str() : nullptr };
+    PGresult* resultExec = PQexecParams(
+        in_connection,
+        MBASE_NLQ_PSQL_FINGERPRINT_QUERY,
+        1, nullptr, paramValues, nullptr, nullptr, 0
+    );
+
+    if(PQresultStatus(resultExec) != ExecStatusType::PGRES_TUPLES_OK || PQntuples(resultExec) != 1)
+    {
+        PQclear(resultExec);
+        return false;
+    }
+    out_fingerprint = PQgetvalue(resultExec, 0, 0);
+    PQclear(resultExec);
+    return true;
+}
+
+GENERIC psql_cancel_query(PGconn* in_connection)
+{
+    PGcancel* cancelObject = PQgetCancel(in_connection);
+    if(cancelObject)
+    {
+        char errorBuffer[256];
+        PQcancel(cancelObject, errorBuffer, sizeof(errorBuffer));
+        PQfreeCancel(cancelObject);
+    }
+}
+
+// What PostgreSQL said about a failed statement
+struct psql_error_info {
+    mbase::string mSqlState;
+    mbase::string mMessage;
+};
+
+inline GENERIC psql_read_error(const PGresult* in_result, psql_error_info& out_error)
+{
+    const char* sqlState = PQresultErrorField(in_result, PG_DIAG_SQLSTATE);
+    out_error.mSqlState = sqlState ? sqlState : "";
+    out_error.mMessage = PQresultErrorMessage(in_result);
+}
+
+/*
+    Whether the model has a chance to fix the statement: syntax errors, unknown tables and columns, type mismatches and
+    invalid values. Missing privileges, timeouts and the read only mode won't go away with a different statement.
+*/
+inline bool psql_is_repairable(const psql_error_info& in_error)
+{
+    if(in_error.mSqlState.size() != 5 || in_error.mSqlState == "42501")
+    {
+        return false;
+    }
+    return !strncmp(in_error.mSqlState.c_str(), "42", 2) || !strncmp(in_error.mSqlState.c_str(), "22", 2);
+}
+
+// read_only_sql_transaction, what a hot standby answers to a write that sql_inspect_statement took for a read
+inline bool psql_is_read_only_violation(const psql_error_info& in_error)
+{
+    return in_error.mSqlState == "25006";
 }
 
-bool psql_get_all_tables(PGconn* in_connection)
+// libpq takes a single result format for all columns, binary is only used if every column can be decoded from it
+I32 psql_pick_result_format(const PGresult* in_describe_result)
 {
-    if(gEnableDbMetafile)
+    I32 resultFormat = PQnfields(in_describe_result) ? 1 : 0;
+    for(I32 i = 0; i < PQnfields(in_describe_result); ++i)
     {
-        mbase::string cachedTableJsonString = mbase::read_file_as_string("table.json");
-        if(cachedTableJsonString.size())
+        if(!psql_is_binary_decodable(PQftype(in_describe_result, i)))
         {
-            // reading from cached table metadata
-            printf("INFO: Reading from cached schema information!\n");
-            mbase::Json tableMetaInformation = mbase::Json::parse(cachedTableJsonString).second;
-            std::map<mbase::string, mbase::Json> schemaObject = tableMetaInformation.getObject();
-            for(auto& n : schemaObject)
-            {
-                for(mbase::Json& metadataObject : n.second.getArray())
-                {
-                    build_table_metadata(n.first, metadataObject["table"].getString(), metadataObject["meta"].getArray());
-                }
-            }
-            return true;
+            resultFormat = 0;
+            break;
         }
     }
-    
+    return resultFormat;
+}
+
+/*
+    Single statements are prepared and described first so that the result can be requested
+    in the binary format when every column type has a binary decoder. Multi statement
+    strings can't be prepared, they are sent as they are and come back in the text format.
+    out_error is filled if the statement is rejected while it is prepared or described.
+*/
+bool psql_send_query(PGconn* in_connection, const sql_statement_info& in_info, const mbase::string& in_sql, psql_error_info* out_error = nullptr)
+{
+    if(in_info.bIsMultiStatement)
+    {
+        return PQsendQuery(in_connection, in_sql.c_str());
+    }
 
-    if(!gProvidedSchemas.size())
+    PGresult* prepareResult = PQprepare(in_connection, "", in_sql.c_str(), 0, nullptr);
+    if(PQresultStatus(prepareResult) != ExecStatusType::PGRES_COMMAND_OK)
     {
-        // Retrieve all schemas from the database
-        mbase::string getSchemasQuery = "SELECT nspname FROM pg_namespace";
-        PGresult* resultExec = PQexec(in_connection, getSchemasQuery.c_str());
-    
-        ExecStatusType est = PQresultStatus(resultExec);
-        if(est != ExecStatusType::PGRES_TUPLES_OK)
+        // parse and analysis errors (unknown columns and such) of a single statement come from here, not from the execution
+        if(out_error)
         {
-            if(resultExec)
-            {
-                PQclear(resultExec);
-            }
+            psql_read_error(prepareResult, *out_error);
         }
-        else
+        PQclear(prepareResult);
+        return false;
+    }
+    PQclear(prepareResult);
+
+    PGresult* describeResult = PQdescribePrepared(in_connection, "");
+    if(PQresultStatus(describeResult) != ExecStatusType::PGRES_COMMAND_OK)
+    {
+        if(out_error)
+        {
+            psql_read_error(describeResult, *out_error);
+        }
+        PQclear(describeResult);
+        return false;
+    }
+
+    I32 resultFormat = psql_pick_result_format(describeResult);
+    PQclear(describeResult);
+
+    return PQsendQueryPrepared(in_connection, "", 0, nullptr, nullptr, nullptr, resultFormat);
+}
+
+/*
+    Reads the results of a sent query batch by batch. Only the rows of the current
+    result set are counted against in_max_rows; beyond that the query is cancelled and
+    the rest is drained so that the client memory stays bounded by the row limit.
+*/
+class PsqlResultReader {
+public:
+    PsqlResultReader(PGconn* in_connection, I32 in_max_rows) : mConnection(in_connection), mMaxRows(in_max_rows)
+    {
+    }
+
+    /*
+        Returns the next batch of rows (the caller owns it) or null once the query is finished.
+        The first batch of every result set is returned even if it has no rows so that its
+        columns can be described; out_is_new_set is set for it.
+    */
+    PGresult* next(bool& out_is_new_set)
+    {
+        out_is_new_set = false;
+        while(PGresult* resultExec = PQgetResult(mConnection))
         {
-            int tupleCount = PQntuples(resultExec);
-            for(int i = 0; i < tupleCount; i++)
+            ExecStatusType est = PQresultStatus(resultExec);
+            if(bIsFailed || bIsTooMuchData)
             {
-                mbase::string currentSchemaName(PQgetvalue(resultExec, i, 0));
-                if(currentSchemaName == "information_schema" || currentSchemaName == "pg_catalog" || currentSchemaName == "pg_toast")
+                // draining whatever is left after the error or the cancel request
+            }
+
+            else if(est == ExecStatusType::PGRES_SINGLE_TUPLE || est == MBASE_NLQ_PSQL_TUPLES_CHUNK || est == ExecStatusType::PGRES_TUPLES_OK)
+            {
+                bool isNewSet = bIsNewResultSet;
+                if(bIsNewResultSet)
+                {
+                    bIsNewResultSet = false;
+                    bHasResultSet = true;
+                    mRowCount = 0;
+                }
+
+                if(est == ExecStatusType::PGRES_TUPLES_OK)
+                {
+                    // end of the current result set
+                    bIsNewResultSet = true;
+                }
+
+                if(mRowCount + PQntuples(resultExec) > mMaxRows)
+                {
+                    // Prompt returned a result which contains more than mMaxRows rows
+                    bIsTooMuchData = true;
+                    psql_cancel_query(mConnection);
+                }
+
+                else if(PQntuples(resultExec) || isNewSet)
                 {
-                    continue;
+                    mRowCount += PQntuples(resultExec);
+                    out_is_new_set = isNewSet;
+                    return resultExec;
                 }
-                gProvidedSchemas.insert(currentSchemaName);
             }
+
+            else if(est == ExecStatusType::PGRES_COMMAND_OK)
+            {
+                // means db is modified
+                bIsModified = true;
+            }
+
+            else
+            {
+                bIsFailed = true;
+                psql_read_error(resultExec, mError);
+            }
+            PQclear(resultExec);
         }
+        return nullptr;
     }
 
-    mbase::string outputTables;
-    mbase::Json totalJson;
-
-    for(const mbase::string& schemaName: gProvidedSchemas)
+    // Valid once next returned null
+    I32 get_status() const
     {
-        totalJson[schemaName].setArray();
-        //mbase::string getTablesQuery = mbase::string::from_format("SELECT t.table_name, json_agg( json_build_object( 'column_name', c.column_name, 'data_type', c.data_type ) ) AS columns FROM information_schema.tables t JOIN information_schema.columns c ON t.table_name = c.table_name WHERE t.table_schema = '%s' AND t.table_type = 'BASE TABLE' AND c.table_schema = '%s' GROUP BY t.table_name;", schemaName.c_str(), schemaName.c_str());
-        //mbase::string getTablesQuery = mbase::string::from_format("SELECT t.table_name, json_agg( json_build_object( 'column_name', c.column_name, 'data_type', c.data_type, 'constraint_type', tc.constraint_type, 'referenced_table', ccu.table_name, 'referenced_column', ccu.column_name ) ) AS columns FROM information_schema.tables t JOIN information_schema.columns c ON t.table_name = c.table_name AND t.table_schema = c.table_schema LEFT JOIN information_schema.key_column_usage kcu ON c.table_name = kcu.table_name AND c.column_name = kcu.column_name AND c.table_schema = kcu.table_schema LEFT JOIN information_schema.table_constraints tc ON kcu.constraint_name = tc.constraint_name AND kcu.table_schema = tc.table_schema LEFT JOIN information_schema.constraint_column_usage ccu ON tc.constraint_type = 'FOREIGN KEY' AND tc.constraint_name = ccu.constraint_name AND tc.table_schema = ccu.table_schema WHERE t.table_schema = '%s' AND t.table_type = 'BASE TABLE' GROUP BY t.table_name;", schemaName.c_str());
-        mbase::string getTablesQuery = mbase::string::from_format("SELECT t.table_name, json_agg( json_build_object( 'column_name', c.column_name, 'data_type', c.data_type, 'constraint_type', tc.constraint_type, 'referenced_table', ccu.table_name, 'referenced_column', ccu.column_name ) ) AS columns FROM information_schema.tables t JOIN information_schema.columns c ON t.table_name = c.table_name AND t.table_schema = c.table_schema LEFT JOIN information_schema.key_column_usage kcu ON c.table_name = kcu.table_name AND c.column_name = kcu.column_name AND c.table_schema = kcu.table_schema LEFT JOIN information_schema.table_constraints tc ON kcu.constraint_name = tc.constraint_name AND kcu.table_schema = tc.table_schema LEFT JOIN information_schema.constraint_column_usage ccu ON tc.constraint_type = 'FOREIGN KEY' AND tc.constraint_name = ccu.constraint_name AND tc.table_schema = ccu.table_schema WHERE t.table_schema = '%s' AND t.table_type = 'BASE TABLE' GROUP BY t.table_name;", schemaName.c_str());
-        PGresult* resultExec = PQexec(in_connection, getTablesQuery.c_str());
-    
-        ExecStatusType est = PQresultStatus(resultExec);
-        if(est != ExecStatusType::PGRES_TUPLES_OK)
+        if(bIsTooMuchData)
         {
-            if(resultExec)
-            {
-                PQclear(resultExec);
-            }
-            return false;
+            return NLQ_TOO_MUCH_DATA;
         }
-        
-        mbase::vector<mbase::Json>& jsonArray = totalJson[schemaName].getArray();
-        int tupleCount = PQntuples(resultExec);
-        for(int i = 0; i < tupleCount; i++)
+
+        if(bIsFailed || (!bIsModified && !bHasResultSet))
         {
-            mbase::string tableName = PQgetvalue(resultExec, i, 0);
-            mbase::string tableMetaData = PQgetvalue(resultExec, i, 1);
+            return NLQ_DB_ERR;
+        }
+        return NLQ_SUCCESS;
+    }
 
-            mbase::Json tableDescriptionJson;
-            mbase::Json metadataJsonArray = mbase::Json::parse(tableMetaData).second;
+    bool has_result_set() const
+    {
+        return bHasResultSet;
+    }
 
-            tableDescriptionJson["table"] = tableName;
-            tableDescriptionJson["meta"] = metadataJsonArray;
+    const psql_error_info& get_error() const
+    {
+        return mError;
+    }
 
-            build_table_metadata(schemaName, tableName, metadataJsonArray.getArray());
+private:
+    PGconn* mConnection;
+    I32 mMaxRows;
+    I32 mRowCount = 0;
+    psql_error_info mError;
+    bool bIsModified = false;
+    bool bIsFailed = false;
+    bool bIsTooMuchData = false;
+    bool bIsNewResultSet = true;
+    bool bHasResultSet = false;
+};
 
-            jsonArray.push_back(tableDescriptionJson);
+// Consumes all results of a sent query into out_rows, like PQexec only the last result set is kept. out_error is filled on NLQ_DB_ERR
+bool psql_collect_rows(PGconn* in_connection, I32 in_max_rows, PsqlResultBuffer& out_rows, bool& out_has_result_set, I32& out_status, psql_error_info* out_error = nullptr)
+{
+    PsqlResultReader resultReader(in_connection, in_max_rows);
+    bool isNewSet = false;
+    while(PGresult* resultBatch = resultReader.next(isNewSet))
+    {
+        if(isNewSet)
+        {
+            out_rows.begin_result_set(resultBatch);
+        }
+
+        if(PQntuples(resultBatch))
+        {
+            out_rows.push(resultBatch); // the buffer owns it now
+        }
+        else
+        {
+            PQclear(resultBatch);
         }
-    
-        PQclear(resultExec);    
     }
-    if(gEnableDbMetafile)
+
+    out_has_result_set = resultReader.has_result_set();
+    out_status = resultReader.get_status();
+    if(out_error)
     {
-        mbase::write_string_to_file("table.json", totalJson.toStringPretty());
+        *out_error = resultReader.get_error();
     }
-    return true;
+    return out_status == NLQ_SUCCESS;
 }
 
-bool psql_produce_output(PGconn* in_connection, NlqModel* in_model, bool in_genonly, const mbase::string& in_prompt, const mbase::string& in_sql_history, mbase::Json& out_json, I32& out_status, mbase::string& out_sql)
+/*
+    Decodes the answer to in_context on a processor the caller holds. The system prompt stays locked in the KV cache
+    of the processor, only the lines of in_context are prefilled.
+    in_connection is null for generate only requests, otherwise it may still be connecting while the model decodes
+*/
+bool psql_decode_sql(PostgrePooledConnection* in_connection, NlqProcessor* in_processor, mbase::context_line* in_context, size_type in_line_count, mbase::string& out_sql, I32& out_status)
 {
-    NlqProcessor* activeProcessor = NULL;
-    if(!in_model->acquire_processor(activeProcessor))
-    {
-        out_status = NLQ_ENGINE_OVERLOADED;
-        return false;
-    }
-    mbase::context_line ctxLine;
-    ctxLine.mMessage = in_prompt;
-    ctxLine.mRole = mbase::context_role::USER;
     mbase::inf_text_token_vector tokenVector;
-    if(activeProcessor->tokenize_input(&ctxLine, 1, tokenVector) == NlqProcessor::flags::INF_PROC_ERR_UNABLE_TO_TOKENIZE_INPUT)
+    if(in_processor->tokenize_input(in_context, in_line_count, tokenVector) == NlqProcessor::flags::INF_PROC_ERR_UNABLE_TO_TOKENIZE_INPUT)
     {
         out_status = NLQ_INTERNAL_SERVER_ERROR;
-        in_model->release_processor(activeProcessor);
         return false;
     }
-    NlqClient* clientPtr = static_cast<NlqClient*>(activeProcessor->get_assigned_client());
+    NlqClient* clientPtr = static_cast<NlqClient*>(in_processor->get_assigned_client());
     clientPtr->query_hard_reset();
-    if(activeProcessor->execute_input_sync(tokenVector) != NlqProcessor::flags::INF_PROC_INFO_NEED_UPDATE)
+    if(in_processor->execute_input_sync(tokenVector) != NlqProcessor::flags::INF_PROC_INFO_NEED_UPDATE)
     {
         out_status = NLQ_INTERNAL_SERVER_ERROR;
-        in_model->release_processor(activeProcessor);
         return false;
     }
     gLoopSync.acquire();
-    activeProcessor->update();
+    in_processor->update();
     gLoopSync.release();
     while(clientPtr->is_processing())
     {
+        if(in_connection && in_connection->isConnecting())
+        {
+            // hide the connection handshake behind the inference
+            in_connection->poll_connect();
+        }
         mbase::sleep(2); // prevent overuse
     }
 
     mbase::string genSql = clientPtr->get_generated_query();
-
-    in_model->release_processor(activeProcessor);
     if(genSql.contains("NLQ_INV"))
     {
         out_status = NLQ_PROMPT_INVALID;
@@ -272,83 +646,303 @@ bool psql_produce_output(PGconn* in_connection, NlqModel* in_model, bool in_geno
         }
     }
 
-    if(in_genonly)
+    out_sql = genSql;
+    return true;
+}
+
+bool psql_generate_sql(PostgrePooledConnection* in_connection, NlqModel* in_model, nlq_database* in_database, const mbase::string& in_prompt, mbase::string& out_sql, I32& out_status)
+{
+    NlqProcessorLease processorLease(in_model, *in_database);
+    if(!processorLease.get())
+    {
+        out_status = NLQ_ENGINE_OVERLOADED;
+        return false;
+    }
+    mbase::context_line ctxLine;
+    ctxLine.mMessage = in_prompt;
+    ctxLine.mRole = mbase::context_role::USER;
+    return psql_decode_sql(in_connection, processorLease.get(), &ctxLine, 1, out_sql, out_status);
+}
+
+// Waits for the connection, applies the row limit and sends the generated SQL in the row streaming mode. out_error is filled on NLQ_DB_ERR
+bool psql_start_query(PostgrePooledConnection* in_connection, const mbase::string& in_sql, I32 in_max_rows, I32& out_status, psql_error_info* out_error = nullptr)
+{
+    if(!in_connection || !in_connection->wait_connected())
     {
-        out_json["status"] = NLQ_SUCCESS;
-        out_json["sql"] = genSql;
-        return true;
+        out_status = NLQ_CONNECTION_FAILED;
+        return false;
     }
 
-    PGresult* resultExec = PQexec(in_connection, genSql.c_str());
-    if(!resultExec)
+    // push the row limit down so that PostgreSQL can plan for early termination
+    sql_statement_info statementInfo;
+    sql_inspect_statement(in_sql, statementInfo);
+    mbase::string execSql = sql_apply_row_limit(statementInfo, in_sql, in_max_rows);
+
+    PGconn* dbConnection = in_connection->get_connection_ptr();
+    if(!psql_send_query(dbConnection, statementInfo, execSql, out_error))
     {
-        out_status = NLQ_INTERNAL_SERVER_ERROR;
-        out_sql = genSql;
+        out_status = NLQ_DB_ERR;
         return false;
     }
 
-    ExecStatusType est = PQresultStatus(resultExec);
-    if(est == ExecStatusType::PGRES_COMMAND_OK)
+    // rows are consumed as they arrive so that the client memory is bounded by the row limit, not by the table size
+#ifdef LIBPQ_HAS_CHUNK_MODE
+    PQsetChunkedRowsMode(dbConnection, MBASE_NLQ_PSQL_CHUNK_ROWS);
+#else
+    PQsetSingleRowMode(dbConnection);
+#endif
+    return true;
+}
+
+/*
+    Starts a CSV export of a generated read query through COPY TO STDOUT.
+    On success the connection is in the COPY OUT state and the rows are read with PQgetCopyData.
+*/
+bool psql_start_copy(PostgrePooledConnection* in_connection, const mbase::string& in_sql, I32 in_max_rows, I32& out_status)
+{
+    if(!in_connection || !in_connection->wait_connected())
     {
-        // means db is modified
-        out_json["status"] = NLQ_SUCCESS;
-        out_json["sql"] = genSql;
+        out_status = NLQ_CONNECTION_FAILED;
+        return false;
     }
 
-    else if(est == ExecStatusType::PGRES_TUPLES_OK)
+    // COPY only accepts a single query, modifying statements are never exported
+    sql_statement_info statementInfo;
+    sql_inspect_statement(in_sql, statementInfo);
+    if(!statementInfo.bIsReadOnly)
     {
-        // means data is read from db
-        out_json["status"] = NLQ_SUCCESS;
-        out_json["sql"] = genSql;
-        out_json["data"].setObject();
-        for(I32 i = 0; i < PQnfields(resultExec); ++i)
+        out_status = NLQ_EXPORT_NOT_READ_ONLY;
+        return false;
+    }
+
+    mbase::string copySql = "COPY (" + sql_apply_row_limit(statementInfo, in_sql, in_max_rows) + ") TO STDOUT WITH (FORMAT csv, HEADER)";
+    PGconn* dbConnection = in_connection->get_connection_ptr();
+    if(!PQsendQuery(dbConnection, copySql.c_str()))
+    {
+        out_status = NLQ_DB_ERR;
+        return false;
+    }
+
+    // errors in the query show up here, before anything is sent to the client
+    PGresult* copyResult = PQgetResult(dbConnection);
+    bool isCopyOut = copyResult && PQresultStatus(copyResult) == ExecStatusType::PGRES_COPY_OUT;
+    PQclear(copyResult);
+    if(!isCopyOut)
+    {
+        while(PGresult* remainingResult = PQgetResult(dbConnection))
         {
-            mbase::string fieldName = PQfname(resultExec, i);
-            out_json["data"][fieldName].setArray();
-            I32 rowCounter = 0;
-            for(I32 j = 0; j < PQntuples(resultExec); ++j)
-            {
-                if(rowCounter == gMaxRows)
-                {
-                    // Prompt returned a result which contains more than 1000 rows
-                    out_status = NLQ_TOO_MUCH_DATA;
-                    out_sql = genSql;
-                    break;
-                }
-                I32 binaryLength = PQgetlength(resultExec, j, i);
-                mbase::string dataString(PQgetvalue(resultExec, j, i), binaryLength);
-                if(binaryLength <= 64)
-                {
-                    if(dataString.is_integer(dataString.c_str()))
-                    {
-                        out_json["data"][fieldName][j] = dataString.to_i64();
-                    }
-                    else if(dataString.is_float(dataString.c_str()))
-                    {
-                        out_json["data"][fieldName][j] = dataString.to_f64();
-                    }
-                    else
-                    {
-                        out_json["data"][fieldName][j] = dataString;
-                    }
-                }
-                else
-                {
-                    out_json["data"][fieldName][j] = dataString;
-                }
-            }
+            PQclear(remainingResult);
         }
+        out_status = NLQ_DB_ERR;
+        return false;
+    }
+    return true;
+}
+
+#define MBASE_NLQ_PSQL_CURSOR_NAME "nlq_cursor"
+
+/*
+    Declares a cursor for a single read statement in a transaction of its own.
+    The connection stays in that transaction until psql_close_cursor, pages are read with psql_fetch_page.
+*/
+bool psql_open_cursor(PostgrePooledConnection* in_connection, const sql_statement_info& in_info, I32& out_result_format, I32& out_status)
+{
+    if(!in_connection || !in_connection->wait_connected())
+    {
+        out_status = NLQ_CONNECTION_FAILED;
+        return false;
     }
 
-    else
+    PGconn* dbConnection = in_connection->get_connection_ptr();
+    mbase::string declareSql = "BEGIN;\nDECLARE " MBASE_NLQ_PSQL_CURSOR_NAME " NO SCROLL CURSOR FOR\n" + in_info.mStatement + "\n;";
+    PGresult* declareResult = PQexec(dbConnection, declareSql.c_str());
+    bool isDeclared = PQresultStatus(declareResult) == ExecStatusType::PGRES_COMMAND_OK;
+    PQclear(declareResult);
+    if(!isDeclared)
     {
-        out_sql = genSql;
+        PQclear(PQexec(dbConnection, "ROLLBACK"));
         out_status = NLQ_DB_ERR;
-        PQclear(resultExec);
         return false;
     }
-    out_sql = genSql;
-    PQclear(resultExec);
+
+    // a declared cursor is a portal, so its columns can be described before anything is fetched
+    PGresult* describeResult = PQdescribePortal(dbConnection, MBASE_NLQ_PSQL_CURSOR_NAME);
+    out_result_format = PQresultStatus(describeResult) == ExecStatusType::PGRES_COMMAND_OK ? psql_pick_result_format(describeResult) : 0;
+    PQclear(describeResult);
+    return true;
+}
+
+// Fetches the next page into out_rows, fewer rows than in_page_size means the cursor is exhausted
+bool psql_fetch_page(PGconn* in_connection, I32 in_page_size, I32 in_result_format, PsqlResultBuffer& out_rows, I32& out_status)
+{
+    mbase::string fetchSql = mbase::string::from_format("FETCH FORWARD %d FROM " MBASE_NLQ_PSQL_CURSOR_NAME, in_page_size);
+    PGresult* fetchResult = PQexecParams(in_connection, fetchSql.c_str(), 0, nullptr, nullptr, nullptr, nullptr, in_result_format);
+    if(PQresultStatus(fetchResult) != ExecStatusType::PGRES_TUPLES_OK)
+    {
+        PQclear(fetchResult);
+        out_status = NLQ_DB_ERR;
+        return false;
+    }
+
+    out_rows.begin_result_set(fetchResult);
+    out_rows.push(fetchResult);
+    return true;
+}
+
+GENERIC psql_close_cursor(PGconn* in_connection)
+{
+    // ends the transaction, the connection goes back to the pool clean
+    PQclear(PQexec(in_connection, "ROLLBACK"));
+}
+
+struct psql_exec_limits {
+    I32 mStatementTimeout = 0; // in milliseconds, 0 leaves the database default
+    I32 mLockTimeout = 0;
+};
+
+/*
+    Session settings for the generated SQL of this request, sent in one round trip before it is executed.
+    Only the settings that differ from the defaults are sent; DISCARD ALL resets them when the connection
+    goes back to the pool. With --force-read-only the generated SQL runs in an implicit (or the cursor's)
+    read only transaction. That alone doesn't stop a multi statement string from turning it off, the caller
+    has to let only single read statements through.
+*/
+bool psql_apply_exec_limits(PostgrePooledConnection* in_connection, const psql_exec_limits& in_limits, I32& out_status)
+{
+    if(!in_connection || !in_connection->wait_connected())
+    {
+        out_status = NLQ_CONNECTION_FAILED;
+        return false;
+    }
+
+    mbase::string limitSql;
+    if(in_limits.mStatementTimeout > 0)
+    {
+        limitSql += mbase::string::from_format("SET statement_timeout = %d;", in_limits.mStatementTimeout);
+    }
+    if(in_limits.mLockTimeout > 0)
+    {
+        limitSql += mbase::string::from_format("SET lock_timeout = %d;", in_limits.mLockTimeout);
+    }
+    if(gForceReadOnly)
+    {
+        limitSql += "SET default_transaction_read_only = on;";
+    }
+
+    if(!limitSql.size())
+    {
+        return true;
+    }
+
+    PGresult* limitResult = PQexec(in_connection->get_connection_ptr(), limitSql.c_str());
+    bool isApplied = PQresultStatus(limitResult) == ExecStatusType::PGRES_COMMAND_OK;
+    PQclear(limitResult);
+    if(!isApplied)
+    {
+        out_status = NLQ_DB_ERR;
+    }
+    return isApplied;
+}
+
+struct nlq_cost_estimate {
+    F64 mTotalCost = 0;
+    F64 mPlanRows = 0;
+};
+
+// Reads a number member of the root plan, which comes before the "Plans" of its children in the EXPLAIN output
+inline F64 psql_plan_number(const char* in_plan_json, const char* in_key)
+{
+    const char* keyPosition = strstr(in_plan_json, in_key);
+    return keyPosition ? strtod(keyPosition + strlen(in_key), nullptr) : 0;
+}
+
+/*
+    Pre-flight check of a generated statement with EXPLAIN (FORMAT JSON), nothing is executed.
+    The statement is explained with the same row limit it is executed with, in_max_rows is 0 for cursors.
+    Fails with NLQ_QUERY_TOO_EXPENSIVE if the estimate is over --max-query-cost or --max-estimated-rows.
+    Multi statement strings and statements that have no plan can't be estimated, they are treated as over the limit.
+    out_error is filled if PostgreSQL rejects the statement while planning it.
+*/
+bool psql_check_query_cost(PostgrePooledConnection* in_connection, const mbase::string& in_sql, I32 in_max_rows, nlq_cost_estimate& out_estimate, I32& out_status, psql_error_info* out_error = nullptr)
+{
+    if(gMaxQueryCost <= 0 && gMaxEstimatedRows <= 0)
+    {
+        return true;
+    }
+
+    if(!in_connection || !in_connection->wait_connected())
+    {
+        out_status = NLQ_CONNECTION_FAILED;
+        return false;
+    }
+
+    sql_statement_info statementInfo;
+    sql_inspect_statement(in_sql, statementInfo);
+    if(statementInfo.bIsMultiStatement)
+    {
+        out_status = NLQ_QUERY_TOO_EXPENSIVE;
+        return false;
+    }
+
+    // utility statements (CALL, CREATE TABLE AS, EXPLAIN ANALYZE ...) can't be explained without running them
+    const mbase::string& leadingKeyword = statementInfo.mLeadingKeyword;
+    if(!(leadingKeyword == "select" || leadingKeyword == "with" || leadingKeyword == "values" || leadingKeyword == "table" ||
+        leadingKeyword == "insert" || leadingKeyword == "update" || leadingKeyword == "delete" || leadingKeyword == "merge"))
+    {
+        out_status = NLQ_QUERY_TOO_EXPENSIVE;
+        return false;
+    }
+
+    mbase::string explainSql = "EXPLAIN (FORMAT JSON)\n" + sql_apply_row_limit(statementInfo, statementInfo.mStatement, in_max_rows);
+    PGresult* explainResult = PQexec(in_connection->get_connection_ptr(), explainSql.c_str());
+    if(PQresultStatus(explainResult) != ExecStatusType::PGRES_TUPLES_OK || PQntuples(explainResult) != 1)
+    {
+        if(out_error)
+        {
+            psql_read_error(explainResult, *out_error);
+        }
+        PQclear(explainResult);
+        out_status = NLQ_DB_ERR;
+        return false;
+    }
+
+    const char* planJson = PQgetvalue(explainResult, 0, 0);
+    out_estimate.mTotalCost = psql_plan_number(planJson, "\"Total Cost\":");
+    out_estimate.mPlanRows = psql_plan_number(planJson, "\"Plan Rows\":");
+    PQclear(explainResult);
+
+    if((gMaxQueryCost > 0 && out_estimate.mTotalCost > gMaxQueryCost) || (gMaxEstimatedRows > 0 && out_estimate.mPlanRows > gMaxEstimatedRows))
+    {
+        out_status = NLQ_QUERY_TOO_EXPENSIVE;
+        return false;
+    }
+    return true;
+}
+
+// Runs generated SQL and writes the whole response, in_options.bIsArrow requests an arrow IPC stream for the result set
+bool psql_execute_output(PostgrePooledConnection* in_connection, const mbase::string& in_sql, const nlq_output_options& in_options, I32 in_max_rows, std::pmr::memory_resource* in_arena, std::string& out_body, const char*& out_content_type, I32& out_status, psql_error_info* out_error = nullptr)
+{
+    out_content_type = "application/json";
+    if(!psql_start_query(in_connection, in_sql, in_max_rows, out_status, out_error))
+    {
+        return false;
+    }
+
+    PsqlResultBuffer resultRows;
+    bool hasResultSet = false;
+    if(!psql_collect_rows(in_connection->get_connection_ptr(), in_max_rows, resultRows, hasResultSet, out_status, out_error))
+    {
+        return false;
+    }
+
+    if(in_options.bIsArrow && hasResultSet)
+    {
+        nlq_write_arrow_stream(out_body, in_sql, resultRows);
+        out_content_type = NLQ_ARROW_CONTENT_TYPE;
+        return true;
+    }
+
+    nlq_write_json_response(out_body, in_sql, hasResultSet ? &resultRows : nullptr, in_options, in_arena);
     return true;
 }
 
@@ -0,0 +1,596 @@
+#ifndef MBASE_NLQ_DB_POOL_H
+#define MBASE_NLQ_DB_POOL_H
+
+#include <mbase/common.h>
+#include <mbase/string.h>
+#include <mbase/vector.h>
+#include <mbase/unordered_map.h>
+#include <mbase/synchronization.h>
+#include <libpq-fe.h>
+#include <chrono>
+#include <memory>
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <sys/select.h>
+#endif
+#include "global_state.h"
+
+MBASE_BEGIN
+
+inline mbase::string psql_make_conninfo(
+    const mbase::string& in_hostname,
+    const I32& in_port,
+    const mbase::string& in_dbname,
+    const mbase::string& in_username,
+    const mbase::string& in_password
+)
+{
+    return mbase::string::from_format("host=%s port=%d dbname=%s user=%s password=%s connect_timeout=2 sslmode=allow", in_hostname.c_str(), in_port, in_dbname.c_str(), in_username.c_str(), in_password.c_str());
+}
+
+#define MBASE_NLQ_PSQL_CONNECT_TIMEOUT_MS 2000
+
+// Waits until the connection socket is readable/writable or the timeout expires
+inline bool psql_wait_socket(PGconn* in_connection, bool in_for_read, I32 in_timeout_ms)
+{
+    I32 sockFd = PQsocket(in_connection);
+    if(sockFd < 0)
+    {
+        return false;
+    }
+
+    fd_set socketSet;
+    FD_ZERO(&socketSet);
+    FD_SET(sockFd, &socketSet);
+
+    timeval waitTime;
+    waitTime.tv_sec = in_timeout_ms / 1000;
+    waitTime.tv_usec = (in_timeout_ms % 1000) * 1000;
+
+    I32 selectResult = 0;
+    if(in_for_read)
+    {
+        selectResult = select(sockFd + 1, &socketSet, nullptr, nullptr, &waitTime);
+    }
+    else
+    {
+        selectResult = select(sockFd + 1, nullptr, &socketSet, nullptr, &waitTime);
+    }
+    return selectResult > 0;
+}
+
+/*
+    Connections are pooled per (host, port, db, user). The password is part of the key as well
+    so that a client sending different credentials with --force-credentials never receives
+    a connection that was authenticated by somebody else.
+*/
+class PostgreConnectionPool {
+public:
+    using clock_type = std::chrono::steady_clock;
+
+    struct pooled_connection {
+        PGconn* mConnection = nullptr;
+        clock_type::time_point mLastUsed;
+    };
+
+    struct pool_bucket {
+        mbase::vector<pooled_connection> mIdleConnections;
+        I32 mLeasedCount = 0;
+        bool bIsPinned = false; // pinned buckets keep at least gDBPoolMinSize idle connections
+    };
+
+    ~PostgreConnectionPool()
+    {
+        for(auto& n : mBuckets)
+        {
+            for(pooled_connection& pc : n.second.mIdleConnections)
+            {
+                PQfinish(pc.mConnection);
+            }
+        }
+    }
+
+    static mbase::string make_key(
+        const mbase::string& in_hostname,
+        const I32& in_port,
+        const mbase::string& in_dbname,
+        const mbase::string& in_username,
+        const mbase::string& in_password
+    )
+    {
+        mbase::string outKey = mbase::string::from_format("%s:%d/%s@%s", in_hostname.c_str(), in_port, in_dbname.c_str(), in_username.c_str());
+        outKey += '\n';
+        outKey += in_password;
+        return outKey;
+    }
+
+    // Opens gDBPoolMinSize connections for the given key upfront and keeps them alive against idle eviction
+    I32 prewarm(
+        const mbase::string& in_hostname,
+        const I32& in_port,
+        const mbase::string& in_dbname,
+        const mbase::string& in_username,
+        const mbase::string& in_password
+    )
+    {
+        mbase::string poolKey = make_key(in_hostname, in_port, in_dbname, in_username, in_password);
+        mbase::string connInfo = psql_make_conninfo(in_hostname, in_port, in_dbname, in_username, in_password);
+        I32 openedCount = 0;
+        {
+            mbase::lock_guard lockGuard(mPoolSync);
+            mBuckets[poolKey].bIsPinned = true;
+        }
+
+        for(I32 i = 0; i < gDBPoolMinSize; i++)
+        {
+            PGconn* newConnection = PQconnectdb(connInfo.c_str());
+            if(PQstatus(newConnection) != ConnStatusType::CONNECTION_OK)
+            {
+                PQfinish(newConnection);
+                break;
+            }
+            mbase::lock_guard lockGuard(mPoolSync);
+            mBuckets[poolKey].mIdleConnections.push_back({newConnection, clock_type::now()});
+            openedCount++;
+        }
+        return openedCount;
+    }
+
+    /*
+        Hands out an idle connection if there is a healthy one, otherwise opens a new one as long as the
+        bucket is below gDBPoolMaxSize. out_overloaded is set if the bucket is exhausted.
+
+        If in_async is set, a new connection is only started with PQconnectStart and out_connecting is set.
+        The caller must then drive it with PQconnectPoll.
+    */
+    PGconn* acquire(
+        const mbase::string& in_hostname,
+        const I32& in_port,
+        const mbase::string& in_dbname,
+        const mbase::string& in_username,
+        const mbase::string& in_password,
+        bool in_async,
+        mbase::string& out_key,
+        bool& out_overloaded,
+        bool& out_connecting
+    )
+    {
+        out_overloaded = false;
+        out_connecting = false;
+        out_key = make_key(in_hostname, in_port, in_dbname, in_username, in_password);
+        mbase::vector<PGconn*> deadConnections;
+        PGconn* outConnection = nullptr;
+        {
+            mbase::lock_guard lockGuard(mPoolSync);
+            pool_bucket& activeBucket = mBuckets[out_key];
+            while(activeBucket.mIdleConnections.size())
+            {
+                // LIFO, the most recently used connection is the most likely to be alive
+                pooled_connection pc = activeBucket.mIdleConnections.back();
+                activeBucket.mIdleConnections.pop_back();
+                if(is_healthy(pc.mConnection))
+                {
+                    outConnection = pc.mConnection;
+                    break;
+                }
+                deadConnections.push_back(pc.mConnection);
+            }
+
+            if(!outConnection && activeBucket.mLeasedCount + (I32)activeBucket.mIdleConnections.size() >= gDBPoolMaxSize)
+            {
+                out_overloaded = true;
+            }
+            else
+            {
+                activeBucket.mLeasedCount++; // reserve the slot before connecting outside of the lock
+            }
+        }
+
+        for(PGconn* deadConn : deadConnections)
+        {
+            PQfinish(deadConn);
+        }
+
+        if(outConnection || out_overloaded)
+        {
+            return outConnection;
+        }
+
+        mbase::string connInfo = psql_make_conninfo(in_hostname, in_port, in_dbname, in_username, in_password);
+        if(in_async)
+        {
+            outConnection = PQconnectStart(connInfo.c_str());
+            if(outConnection && PQstatus(outConnection) != ConnStatusType::CONNECTION_BAD)
+            {
+                out_connecting = true;
+                return outConnection;
+            }
+        }
+        else
+        {
+            outConnection = PQconnectdb(connInfo.c_str());
+        }
+
+        if(PQstatus(outConnection) != ConnStatusType::CONNECTION_OK)
+        {
+            PQfinish(outConnection);
+            mbase::lock_guard lockGuard(mPoolSync);
+            mBuckets[out_key].mLeasedCount--;
+            return nullptr;
+        }
+        return outConnection;
+    }
+
+    // Resets the session state with DISCARD ALL and puts the connection back, or closes it if it is unusable
+    GENERIC release(const mbase::string& in_key, PGconn* in_connection)
+    {
+        bool isReusable = in_connection && PQstatus(in_connection) == ConnStatusType::CONNECTION_OK;
+        if(isReusable && PQtransactionStatus(in_connection) != PGTransactionStatusType::PQTRANS_IDLE)
+        {
+            // an aborted or still running transaction, not worth recovering
+            isReusable = false;
+        }
+
+        if(isReusable)
+        {
+            PGresult* discardResult = PQexec(in_connection, "DISCARD ALL");
+            isReusable = PQresultStatus(discardResult) == ExecStatusType::PGRES_COMMAND_OK;
+            PQclear(discardResult);
+        }
+
+        {
+            mbase::lock_guard lockGuard(mPoolSync);
+            pool_bucket& activeBucket = mBuckets[in_key];
+            activeBucket.mLeasedCount--;
+            if(isReusable)
+            {
+                activeBucket.mIdleConnections.push_back({in_connection, clock_type::now()});
+                return;
+            }
+        }
+
+        if(in_connection)
+        {
+            PQfinish(in_connection);
+        }
+    }
+
+    // Closes connections that have been idle longer than gDBPoolIdleTimeout seconds
+    GENERIC evict_idle()
+    {
+        mbase::vector<PGconn*> evictedConnections;
+        clock_type::time_point timeNow = clock_type::now();
+        {
+            mbase::lock_guard lockGuard(mPoolSync);
+            for(auto It = mBuckets.begin(); It != mBuckets.end();)
+            {
+                pool_bucket& activeBucket = It->second;
+                I32 keepCount = activeBucket.bIsPinned ? gDBPoolMinSize : 0;
+                mbase::vector<pooled_connection> keptConnections;
+
+                // idle list is ordered from the oldest to the most recently used
+                I32 removableCount = (I32)activeBucket.mIdleConnections.size() - keepCount;
+                for(pooled_connection& pc : activeBucket.mIdleConnections)
+                {
+                    I64 idleSeconds = std::chrono::duration_cast<std::chrono::seconds>(timeNow - pc.mLastUsed).count();
+                    if(removableCount > 0 && idleSeconds >= gDBPoolIdleTimeout)
+                    {
+                        evictedConnections.push_back(pc.mConnection);
+                        removableCount--;
+                    }
+                    else
+                    {
+                        keptConnections.push_back(pc);
+                    }
+                }
+                activeBucket.mIdleConnections = keptConnections;
+
+                if(!activeBucket.bIsPinned && !activeBucket.mLeasedCount && !activeBucket.mIdleConnections.size())
+                {
+                    It = mBuckets.erase(It);
+                }
+                else
+                {
+                    ++It;
+                }
+            }
+        }
+
+        for(PGconn* evictedConn : evictedConnections)
+        {
+            PQfinish(evictedConn);
+        }
+    }
+
+private:
+    static bool is_healthy(PGconn* in_connection)
+    {
+        // PQconsumeInput notices a connection that has been closed by the server without a round trip
+        if(PQstatus(in_connection) != ConnStatusType::CONNECTION_OK || !PQconsumeInput(in_connection))
+        {
+            return false;
+        }
+        return PQstatus(in_connection) == ConnStatusType::CONNECTION_OK && PQtransactionStatus(in_connection) == PGTransactionStatusType::PQTRANS_IDLE;
+    }
+
+    mbase::mutex mPoolSync;
+    mbase::unordered_map<mbase::string, pool_bucket> mBuckets;
+};
+
+inline PostgreConnectionPool gPostgreConnectionPool;
+
+/*
+    Hot standbys that generated read queries are balanced over.
+    A read goes to the healthy replica with the fewest outstanding requests; a request counts as outstanding
+    for as long as it holds its connection, streams and cursors included. Replicas are pinged every
+    gReplicaHealthInterval seconds and one that fails a ping or a connection attempt is skipped until it answers again.
+*/
+class PostgreReplicaSet {
+public:
+    struct replica_endpoint {
+        mbase::string mHostname;
+        I32 mPort = 5432;
+        I32 mOutstandingCount = 0;
+        bool bIsHealthy = true;
+    };
+
+    // Only called at startup, before the server starts listening
+    GENERIC add_replica(const mbase::string& in_hostname, const I32& in_port)
+    {
+        replica_endpoint newReplica;
+        newReplica.mHostname = in_hostname;
+        newReplica.mPort = in_port;
+        mReplicas.push_back(newReplica);
+    }
+
+    size_type size() const
+    {
+        return mReplicas.size();
+    }
+
+    // Index of the chosen replica, -1 if none of them is healthy. Every acquire must be followed by a release
+    I32 acquire(mbase::string& out_hostname, I32& out_port)
+    {
+        mbase::lock_guard lockGuard(mSetSync);
+        I32 replicaCount = (I32)mReplicas.size();
+        I32 chosenIndex = -1;
+
+        // ties are broken round robin, otherwise the first replica would take every request under light load
+        mScanStart = replicaCount ? (mScanStart + 1) % replicaCount : 0;
+        for(I32 i = 0; i < replicaCount; ++i)
+        {
+            I32 replicaIndex = (mScanStart + i) % replicaCount;
+            const replica_endpoint& activeReplica = mReplicas[replicaIndex];
+            if(activeReplica.bIsHealthy && (chosenIndex < 0 || activeReplica.mOutstandingCount < mReplicas[chosenIndex].mOutstandingCount))
+            {
+                chosenIndex = replicaIndex;
+            }
+        }
+
+        if(chosenIndex >= 0)
+        {
+            mReplicas[chosenIndex].mOutstandingCount++;
+            out_hostname = mReplicas[chosenIndex].mHostname;
+            out_port = mReplicas[chosenIndex].mPort;
+        }
+        return chosenIndex;
+    }
+
+    GENERIC release(I32 in_index)
+    {
+        mbase::lock_guard lockGuard(mSetSync);
+        mReplicas[in_index].mOutstandingCount--;
+    }
+
+    GENERIC mark_down(I32 in_index)
+    {
+        mbase::lock_guard lockGuard(mSetSync);
+        if(mReplicas[in_index].bIsHealthy)
+        {
+            printf("WARN: Replica %s:%d is unreachable, reads go to the other replicas or the primary\n", mReplicas[in_index].mHostname.c_str(), mReplicas[in_index].mPort);
+        }
+        mReplicas[in_index].bIsHealthy = false;
+    }
+
+    // Pings every replica. It blocks for up to the connect timeout per unreachable replica, so it runs on the maintenance thread
+    GENERIC check_health(const mbase::string& in_dbname, const mbase::string& in_username, const mbase::string& in_password)
+    {
+        // hostnames and ports never change after startup, only the flags are shared
+        for(I32 i = 0; i < (I32)mReplicas.size(); ++i)
+        {
+            mbase::string connInfo = psql_make_conninfo(mReplicas[i].mHostname, mReplicas[i].mPort, in_dbname, in_username, in_password);
+            bool isHealthy = PQping(connInfo.c_str()) == PGPing::PQPING_OK;
+
+            mbase::lock_guard lockGuard(mSetSync);
+            if(isHealthy && !mReplicas[i].bIsHealthy)
+            {
+                printf("INFO: Replica %s:%d is back\n", mReplicas[i].mHostname.c_str(), mReplicas[i].mPort);
+            }
+            else if(!isHealthy && mReplicas[i].bIsHealthy)
+            {
+                printf("WARN: Replica %s:%d is unreachable, reads go to the other replicas or the primary\n", mReplicas[i].mHostname.c_str(), mReplicas[i].mPort);
+            }
+            mReplicas[i].bIsHealthy = isHealthy;
+        }
+    }
+
+private:
+    mbase::mutex mSetSync;
+    mbase::vector<replica_endpoint> mReplicas;
+    I32 mScanStart = 0;
+};
+
+inline PostgreReplicaSet gPostgreReplicaSet;
+
+class PostgrePooledConnection {
+public:
+    PostgrePooledConnection(
+        const mbase::string& in_hostname,
+        const I32& in_port,
+        const mbase::string& in_dbname,
+        const mbase::string& in_username,
+        const mbase::string& in_password,
+        bool in_async = false
+    )
+    {
+        mPostgreConnection = gPostgreConnectionPool.acquire(in_hostname, in_port, in_dbname, in_username, in_password, in_async, mPoolKey, bIsOverloaded, bIsConnecting);
+    }
+
+    ~PostgrePooledConnection()
+    {
+        if(mPostgreConnection)
+        {
+            gPostgreConnectionPool.release(mPoolKey, mPostgreConnection);
+        }
+
+        if(mReplicaIndex >= 0)
+        {
+            gPostgreReplicaSet.release(mReplicaIndex);
+        }
+    }
+
+    PostgrePooledConnection(const PostgrePooledConnection&) = delete;
+    PostgrePooledConnection& operator=(const PostgrePooledConnection&) = delete;
+
+    bool isConnected()
+    {
+        return mPostgreConnection != nullptr && !bIsConnecting;
+    }
+
+    bool isConnecting()
+    {
+        return bIsConnecting;
+    }
+
+    bool isOverloaded()
+    {
+        return bIsOverloaded;
+    }
+
+    PGconn* get_connection_ptr()
+    {
+        return mPostgreConnection;
+    }
+
+    // The connection goes to the replica acquired with this index, which is released together with the connection
+    GENERIC set_replica(I32 in_index)
+    {
+        mReplicaIndex = in_index;
+    }
+
+    bool isReplica()
+    {
+        return mReplicaIndex >= 0;
+    }
+
+    // Advances an asynchronous connection attempt, waiting at most in_timeout_ms for the socket
+    GENERIC poll_connect(I32 in_timeout_ms = 0)
+    {
+        if(!bIsConnecting)
+        {
+            return;
+        }
+
+        if(!psql_wait_socket(mPostgreConnection, mLastPollStatus == PostgresPollingStatusType::PGRES_POLLING_READING, in_timeout_ms))
+        {
+            return;
+        }
+
+        mLastPollStatus = PQconnectPoll(mPostgreConnection);
+        if(mLastPollStatus == PostgresPollingStatusType::PGRES_POLLING_OK)
+        {
+            bIsConnecting = false;
+        }
+
+        else if(mLastPollStatus == PostgresPollingStatusType::PGRES_POLLING_FAILED)
+        {
+            bIsConnecting = false;
+            mark_replica_down();
+            gPostgreConnectionPool.release(mPoolKey, mPostgreConnection); // closes it since the status is bad
+            mPostgreConnection = nullptr;
+        }
+    }
+
+    /*
+        Blocks until the asynchronous connection attempt is complete or its connect timeout expires.
+        The timeout starts with the first wait, the time the model spent decoding doesn't count against it.
+    */
+    bool wait_connected()
+    {
+        PostgreConnectionPool::clock_type::time_point waitStart = PostgreConnectionPool::clock_type::now();
+        while(bIsConnecting)
+        {
+            I64 elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(PostgreConnectionPool::clock_type::now() - waitStart).count();
+            if(elapsedMs >= MBASE_NLQ_PSQL_CONNECT_TIMEOUT_MS)
+            {
+                // the socket may have become ready while the last wait was timing out
+                poll_connect();
+                if(!bIsConnecting)
+                {
+                    break;
+                }
+
+                bIsConnecting = false;
+                gPostgreConnectionPool.release(mPoolKey, mPostgreConnection);
+                mPostgreConnection = nullptr;
+                mark_replica_down();
+                break;
+            }
+            poll_connect((I32)(MBASE_NLQ_PSQL_CONNECT_TIMEOUT_MS - elapsedMs));
+        }
+        return isConnected();
+    }
+private:
+    GENERIC mark_replica_down()
+    {
+        if(mReplicaIndex >= 0)
+        {
+            gPostgreReplicaSet.mark_down(mReplicaIndex);
+        }
+    }
+
+    PGconn* mPostgreConnection = nullptr;
+    mbase::string mPoolKey;
+    I32 mReplicaIndex = -1;
+    PostgresPollingStatusType mLastPollStatus = PostgresPollingStatusType::PGRES_POLLING_WRITING; // initial state after PQconnectStart
+    bool bIsOverloaded = false;
+    bool bIsConnecting = false;
+};
+
+/*
+    Starts an asynchronous connection to the least loaded healthy replica if in_to_replica is set,
+    or to the primary otherwise. A replica that refuses the connection is marked down and the primary is used instead.
+*/
+inline std::unique_ptr<PostgrePooledConnection> psql_connect_routed(
+    const mbase::string& in_hostname,
+    const I32& in_port,
+    const mbase::string& in_dbname,
+    const mbase::string& in_username,
+    const mbase::string& in_password,
+    bool in_to_replica
+)
+{
+    mbase::string replicaHostname;
+    I32 replicaPort = 0;
+    I32 replicaIndex = in_to_replica ? gPostgreReplicaSet.acquire(replicaHostname, replicaPort) : -1;
+    if(replicaIndex >= 0)
+    {
+        std::unique_ptr<PostgrePooledConnection> replicaConnection = std::make_unique<PostgrePooledConnection>(replicaHostname, replicaPort, in_dbname, in_username, in_password, true);
+        replicaConnection->set_replica(replicaIndex);
+        if(replicaConnection->get_connection_ptr())
+        {
+            return replicaConnection;
+        }
+
+        if(!replicaConnection->isOverloaded())
+        {
+            gPostgreReplicaSet.mark_down(replicaIndex);
+        }
+    }
+    return std::make_unique<PostgrePooledConnection>(in_hostname, in_port, in_dbname, in_username, in_password, true);
+}
+
+MBASE_END
+
+#endif // MBASE_NLQ_DB_POOL_H
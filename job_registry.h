@@ -0,0 +1,182 @@
+#ifndef MBASE_NLQ_JOB_REGISTRY_H
+#define MBASE_NLQ_JOB_REGISTRY_H
+
+#include <mbase/common.h>
+#include <mbase/string.h>
+#include <mbase/vector.h>
+#include <mbase/unordered_map.h>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+#include <utility>
+#include <vector>
+#include "global_state.h"
+#include "cursor_registry.h"
+
+MBASE_BEGIN
+
+// What the /nlquery handler answered for a job, replayed as is to the client
+struct nlq_job_result {
+    I32 mHttpStatus = 200;
+    std::string mContentType;
+    std::string mBody;
+    std::vector<std::pair<std::string, std::string>> mHeaders;
+};
+
+// An /nlquery request that is answered in the background
+class NlqJob {
+public:
+    using clock_type = std::chrono::steady_clock;
+
+    enum class job_state {
+        QUEUED,
+        RUNNING,
+        DONE
+    };
+
+    NlqJob(nlq_database* in_database, const std::string& in_body, const std::string& in_authorization, const std::string& in_accept) :
+        mDatabase(in_database),
+        mRequestBody(in_body),
+        mAuthorization(in_authorization),
+        mAccept(in_accept)
+    {
+    }
+
+    NlqJob(const NlqJob&) = delete;
+    NlqJob& operator=(const NlqJob&) = delete;
+
+    nlq_database* get_database() const
+    {
+        return mDatabase;
+    }
+
+    const std::string& get_request_body() const
+    {
+        return mRequestBody;
+    }
+
+    const std::string& get_authorization() const
+    {
+        return mAuthorization;
+    }
+
+    const std::string& get_accept() const
+    {
+        return mAccept;
+    }
+
+private:
+    friend class NlqJobRegistry;
+
+    nlq_database* mDatabase;
+    std::string mRequestBody;
+    std::string mAuthorization;
+    std::string mAccept;
+    job_state mState = job_state::QUEUED;
+    std::shared_ptr<const nlq_job_result> mResult;
+    clock_type::time_point mFinishedAt;
+};
+
+/*
+    Jobs by id, together with the queue of the ones waiting for a worker.
+    At most gJobMaxCount jobs are held in any state; finished ones are dropped by the maintenance
+    thread gJobRetention seconds after they are done, whether their result was read or not.
+*/
+class NlqJobRegistry {
+public:
+    // Empty if the registry is full
+    mbase::string submit(const std::shared_ptr<NlqJob>& in_job)
+    {
+        mbase::string jobId = nlq_make_token();
+        std::lock_guard<std::mutex> lockGuard(mRegistrySync);
+        if((I32)mJobs.size() >= gJobMaxCount)
+        {
+            return mbase::string();
+        }
+        mJobs[jobId] = in_job;
+        mQueuedJobs.push_back(in_job);
+        mQueueSignal.notify_one();
+        return jobId;
+    }
+
+    // Blocks until there is a queued job, which is running from then on
+    std::shared_ptr<NlqJob> wait_next()
+    {
+        std::unique_lock<std::mutex> queueLock(mRegistrySync);
+        mQueueSignal.wait(queueLock, [this]() { return !mQueuedJobs.empty(); });
+        std::shared_ptr<NlqJob> nextJob = mQueuedJobs.front();
+        mQueuedJobs.pop_front();
+        nextJob->mState = NlqJob::job_state::RUNNING;
+        return nextJob;
+    }
+
+    GENERIC finish(const std::shared_ptr<NlqJob>& in_job, std::shared_ptr<const nlq_job_result> in_result)
+    {
+        std::lock_guard<std::mutex> lockGuard(mRegistrySync);
+        in_job->mResult = std::move(in_result);
+        in_job->mState = NlqJob::job_state::DONE;
+        in_job->mFinishedAt = NlqJob::clock_type::now();
+    }
+
+    // false if the id is unknown or expired, out_result is only set once the job is done
+    bool lookup(const mbase::string& in_id, NlqJob::job_state& out_state, std::shared_ptr<const nlq_job_result>& out_result)
+    {
+        std::lock_guard<std::mutex> lockGuard(mRegistrySync);
+        auto It = mJobs.find(in_id);
+        if(It == mJobs.end())
+        {
+            return false;
+        }
+        out_state = It->second->mState;
+        out_result = It->second->mResult;
+        return true;
+    }
+
+    GENERIC reap_expired()
+    {
+        mbase::vector<std::shared_ptr<NlqJob>> expiredJobs; // results are freed outside of the lock
+        NlqJob::clock_type::time_point timeNow = NlqJob::clock_type::now();
+        std::lock_guard<std::mutex> lockGuard(mRegistrySync);
+        for(auto It = mJobs.begin(); It != mJobs.end();)
+        {
+            I64 finishedSeconds = std::chrono::duration_cast<std::chrono::seconds>(timeNow - It->second->mFinishedAt).count();
+            if(It->second->mState == NlqJob::job_state::DONE && finishedSeconds >= gJobRetention)
+            {
+                expiredJobs.push_back(It->second);
+                It = mJobs.erase(It);
+            }
+            else
+            {
+                ++It;
+            }
+        }
+    }
+
+private:
+    std::mutex mRegistrySync;
+    std::condition_variable mQueueSignal;
+    mbase::unordered_map<mbase::string, std::shared_ptr<NlqJob>> mJobs;
+    std::deque<std::shared_ptr<NlqJob>> mQueuedJobs;
+};
+
+inline NlqJobRegistry gNlqJobRegistry;
+
+inline const char* nlq_job_state_name(NlqJob::job_state in_state)
+{
+    switch(in_state)
+    {
+    case NlqJob::job_state::QUEUED:
+        return "queued";
+    case NlqJob::job_state::RUNNING:
+        return "running";
+    default:
+        return "done";
+    }
+}
+
+MBASE_END
+
+#endif // MBASE_NLQ_JOB_REGISTRY_H
@@ -0,0 +1,83 @@
+#ifndef MBASE_NLQ_JSON_WRITER_H
+#define MBASE_NLQ_JSON_WRITER_H
+
+#include <mbase/common.h>
+#include <string>
+#include <charconv>
+
+MBASE_BEGIN
+
+/*
+    Minimal append-only JSON text primitives.
+    Used on the result hot path instead of building a mbase::Json tree and serializing it afterwards.
+*/
+
+inline GENERIC json_append_string(std::string& out_json, const char* in_data, size_type in_length)
+{
+    static const char hexDigits[] = "0123456789abcdef";
+    out_json += '"';
+    size_type runStart = 0;
+    for(size_type i = 0; i < in_length; ++i)
+    {
+        unsigned char currentChar = (unsigned char)in_data[i];
+        if(currentChar >= 0x20 && currentChar != '"' && currentChar != '\\')
+        {
+            continue;
+        }
+
+        out_json.append(in_data + runStart, i - runStart);
+        runStart = i + 1;
+        switch(currentChar)
+        {
+        case '"': out_json += "\\\""; break;
+        case '\\': out_json += "\\\\"; break;
+        case '\n': out_json += "\\n"; break;
+        case '\r': out_json += "\\r"; break;
+        case '\t': out_json += "\\t"; break;
+        case '\b': out_json += "\\b"; break;
+        case '\f': out_json += "\\f"; break;
+        default:
+            out_json += "\\u00";
+            out_json += hexDigits[currentChar >> 4];
+            out_json += hexDigits[currentChar & 0xF];
+            break;
+        }
+    }
+    out_json.append(in_data + runStart, in_length - runStart);
+    out_json += '"';
+}
+
+inline GENERIC json_append_string(std::string& out_json, const std::string& in_string)
+{
+    json_append_string(out_json, in_string.c_str(), in_string.size());
+}
+
+inline GENERIC json_append_i64(std::string& out_json, I64 in_value)
+{
+    char numberBuffer[24];
+    std::to_chars_result convResult = std::to_chars(numberBuffer, numberBuffer + sizeof(numberBuffer), in_value);
+    out_json.append(numberBuffer, convResult.ptr - numberBuffer);
+}
+
+// NaN and infinities have no JSON representation, they are written as strings
+inline GENERIC json_append_f64(std::string& out_json, F64 in_value)
+{
+    if(in_value != in_value)
+    {
+        out_json += "\"NaN\"";
+        return;
+    }
+
+    if(in_value - in_value != 0)
+    {
+        out_json += in_value > 0 ? "\"Infinity\"" : "\"-Infinity\"";
+        return;
+    }
+    char numberBuffer[32];
+    std::to_chars_result convResult = std::to_chars(numberBuffer, numberBuffer + sizeof(numberBuffer), in_value);
+    out_json.append(numberBuffer, convResult.ptr - numberBuffer);
+}
+
+MBASE_END
+
+#endif // MBASE_NLQ_JSON_WRITER_H
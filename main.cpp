@@ -8,7 +8,14 @@
 #include <mbase/inference/inf_gguf_metadata_configurator.h>
 #include "global_state.h"
 #include "db_ops.h"
+#include "result_stream.h"
+#include "copy_stream.h"
+#include "response_compress.h"
+#include "request_arena.h"
+#include "cursor_registry.h"
+#include "job_registry.h"
 #include "model_proc_cl.h"
+#include "schema_refresh.h"
 #include "nlq_status.h"
 #include "httplib.h"
 
@@ -38,124 +45,323 @@ void print_usage()
     printf("--schema <str>                    Schema name to query from. For multiple schemas, specify this option multiple times. If no schema name is provided, the NLQuery engine will query all schema information in the database.\n");
     printf("--user-count <int>                Amount of users that the NLQuery can process simultaneously (default=2).\n");
     printf("--max-rows <int>                  Total number of rows that the NLQuery can return (default=1000).\n");
+    printf("--export-max-rows <int>           Total number of rows that a CSV export can return (default=1000000).\n");
+    printf("--export-max-mb <int>             Size limit of a CSV export in megabytes (default=1024).\n");
+    printf("--compress-min-bytes <int>        Responses smaller than this are sent uncompressed (default=1024).\n");
     printf("--disable-webui                   Disables webui.\n");
     printf("--disable-autodownload            Disables automatic download of the missing LLM model.\n");
-    printf("--enable-dbmeta-file              If this option is set, the program will store the database's table metadata information in a table.json file so that, when the program starts, it will not get table metadata information from the database.\n");
+    printf("--enable-dbmeta-file              If this option is set, the program will cache the database's table metadata and the tokenized system prompt under the program path, which are used at startup as long as the database schema is unchanged.\n");
     printf("--force-credentials               Forces credentials such as username and password to be sent with the message body.\n");
     printf("--hint-file <str>                 Optional text file containing hints and information about the database. If given, may improve performance.\n");
     printf("--db-hostname <str>               Hostname of the postgresql database.\n");
     printf("--db-port <int>                   Port of the database.\n");
-    printf("--db-name <str>                   Name of the database.\n");
+    printf("--db-name <str>                   Name of the database. For multiple databases, specify this option multiple times; they share the model and each gets --user-count processors.\n");
     printf("--db-username <str>               Username to use for accessing to the database.\n");
     printf("--db-password <str>               Password of the database username.\n");
+    printf("--db-pool-min <int>               Number of database connections kept open for the startup credentials (default=1).\n");
+    printf("--db-pool-max <int>               Maximum number of database connections per credential (default=user count).\n");
+    printf("--db-pool-idle-timeout <int>      Seconds after which an idle pooled database connection is closed (default=300).\n");
+    printf("--db-replica <str>                Hot standby for generated read queries as host or host:port. For multiple replicas, specify this option multiple times.\n");
+    printf("--replica-health-interval <int>   Seconds between replica health checks (default=5).\n");
+    printf("--cursor-max-open <int>           Maximum number of paginated results kept open at the same time (default=8).\n");
+    printf("--cursor-idle-timeout <int>       Seconds after which an unread paginated result is closed (default=60).\n");
+    printf("--job-max <int>                   Maximum number of asynchronous jobs kept in memory, queued, running and finished together (default=64).\n");
+    printf("--job-retention <int>             Seconds a finished asynchronous job is kept for its result to be fetched (default=300).\n");
+    printf("--job-retry-timeout <int>         Seconds an asynchronous job is retried while the engine is overloaded before it fails with status 1 (default=60).\n");
+    printf("--schema-refresh-interval <int>   Seconds between database schema change checks, 0 disables them (default=0).\n");
+    printf("--max-query-cost <int>            Highest planner cost estimate a generated query may have to be executed, 0 disables the check (default=0).\n");
+    printf("--max-estimated-rows <int>        Highest row estimate a generated query may have to be executed, 0 disables the check (default=0).\n");
+    printf("--cost-guard-action <str>         What to do with a query over the limits: 'reject' or 'generate' to return it without executing (default=reject).\n");
+    printf("--statement-timeout <int>         Milliseconds a generated query may run, 0 leaves the database default (default=0).\n");
+    printf("--lock-timeout <int>              Milliseconds a generated query may wait for a lock, 0 leaves the database default (default=0).\n");
+    printf("--max-repairs <int>               Times a query rejected by the database is sent back to the model with the error, 0 disables it (default=0).\n");
+    printf("--repair-deadline <int>           Milliseconds after the start of a request in which a rejected query may still be repaired (default=30000).\n");
+    printf("--force-read-only                 Executes only single read queries, in read only transactions.\n");
     printf("--gpu-layers <int>                Number of layers to be offloaded to GPU (default=999).\n\n");
 }
 
-void send_error(const httplib::Request& in_req, httplib::Response& in_resp, int in_status_code, const mbase::string& in_data = "")
+// Returns in_status_code, so that handlers can return the status of the response they set
+int send_error(const httplib::Request& in_req, httplib::Response& in_resp, int in_status_code, const mbase::string& in_data = "")
 {
     mbase::Json errorDesc;
     errorDesc["status"] = in_status_code;
+    errorDesc["message"] = nlq_status_message(in_status_code);
 
-    if(in_status_code == NLQ_ENGINE_OVERLOADED)
+    if(in_data.size())
+    {
+        errorDesc["data"] = in_data;
+    }
+
+    mbase::string outputString = errorDesc.toString();
+    in_resp.set_content(outputString.c_str(), outputString.size(), "application/json");
+    return in_status_code;
+}
+
+void finish_chunked_body(mbase::PsqlCopyStream& in_source, httplib::DataSink& in_sink)
+{
+    // the CSV is already on its way when a limit is hit, the final status goes in the trailer
+    httplib::Headers statusTrailer = {{"X-NLQuery-Status", std::to_string(in_source.get_status())}};
+    in_sink.done_with_trailer(statusTrailer);
+}
+
+template<typename BodySource>
+void finish_chunked_body(BodySource& in_source, httplib::DataSink& in_sink)
+{
+    in_sink.done();
+}
+
+// Sends the chunks of in_source with chunked transfer encoding, compressing them on the fly if an encoding is negotiated
+template<typename BodySource>
+void set_chunked_body(httplib::Response& in_resp, const char* in_content_type, mbase::nlq_content_encoding in_encoding, std::shared_ptr<BodySource> in_source)
+{
+    if(in_encoding != mbase::nlq_content_encoding::IDENTITY)
     {
-        errorDesc["message"] = "NLQuery engine is overloaded. Try again later";
+        in_resp.set_header("Content-Encoding", mbase::nlq_encoding_name(in_encoding));
     }
 
-    else if(in_status_code == NLQ_CONNECTION_FAILED)
+    // the provider runs after the handler returns, so it owns the source and the compressor
+    std::shared_ptr<mbase::NlqStreamCompressor> bodyCompressor = std::make_shared<mbase::NlqStreamCompressor>(in_encoding);
+    in_resp.set_chunked_content_provider(in_content_type, [in_source, bodyCompressor](size_t in_offset, httplib::DataSink& in_sink) {
+        std::string outputChunk;
+        bool hasMore = in_source->next_chunk(outputChunk);
+        if(!bodyCompressor->process(outputChunk, !hasMore))
+        {
+            return false;
+        }
+
+        if(outputChunk.size() && !in_sink.write(outputChunk.data(), outputChunk.size()))
+        {
+            return false;
+        }
+
+        if(!hasMore)
+        {
+            finish_chunked_body(*in_source, in_sink);
+        }
+        return true;
+    });
+}
+
+// Bearer token check against --api-key, sets the response status on failure
+bool check_authorization(const httplib::Request& in_req, httplib::Response& in_resp)
+{
+    if(!gApiKey.size())
     {
-        errorDesc["message"] = "Database connection failed";
+        return true;
+    }
+
+    httplib::Headers::const_iterator authHeader = in_req.headers.find("Authorization");
+    if(authHeader == in_req.headers.end())
+    { 
+        in_resp.status = 401;
+        return false;
     }
 
-    else if(in_status_code == NLQ_PROMPT_INVALID)
+    // 'Bearer' and 'key', checked in place
+    std::string_view authToken = authHeader->second;
+    size_t separatorPos = authToken.find(' ');
+    if(separatorPos == std::string_view::npos || authToken.find(' ', separatorPos + 1) != std::string_view::npos || authToken.substr(0, separatorPos) != "Bearer")
     {
-        errorDesc["message"] = "Given query is invalid. Make sure it is natural language and its context is related to the SQL database";
+        in_resp.status = 401;
+        return false;
     }
 
-    else if(in_status_code == NLQ_INTERNAL_SERVER_ERROR)
+    if(authToken.substr(separatorPos + 1) != std::string_view(gApiKey.c_str(), gApiKey.size()))
     {
-        errorDesc["message"] = "Internal server error. Try again later";
+        in_resp.status = 403;
+        return false;
     }
+    return true;
+}
 
-    else if(in_status_code == NLQ_INVALID_PAYLOAD)
+// Sets a fully built body, compressing it on the way out if it is worth it
+void send_body(httplib::Response& in_resp, std::string&& in_body, const char* in_content_type, mbase::nlq_content_encoding in_encoding)
+{
+    // small bodies aren't worth the compressor setup and the chunked framing
+    if(in_encoding != mbase::nlq_content_encoding::IDENTITY && in_body.size() >= (size_t)gCompressMinBytes)
     {
-        errorDesc["message"] = "Message body is invalid. Make sure you populate the mandatory fields correctly";
+        set_chunked_body(in_resp, in_content_type, in_encoding, std::make_shared<mbase::NlqBufferedBody>(std::move(in_body)));
+        return;
     }
+    in_resp.set_content(std::move(in_body), in_content_type);
+}
 
-    else if(in_status_code == NLQ_NOT_SUPPORTED)
+/*
+    Enforces --force-read-only, sets the timeouts and the transaction mode of the connection and runs the cost guard.
+    in_max_rows is the row limit the query is going to be executed with, 0 for cursors.
+    false means the response is already set, with out_status in it: the query is rejected, or answered without executing it if --cost-guard-action is generate.
+    The exception is a repairable error while the query is estimated, which is left in out_error without a response if out_error is given.
+*/
+bool prepare_execution(const httplib::Request& in_req, httplib::Response& in_resp, mbase::PostgrePooledConnection* in_connection, const mbase::string& in_sql, mbase::I32 in_max_rows, const mbase::psql_exec_limits& in_limits, mbase::I32& out_status, mbase::psql_error_info* out_error = nullptr)
+{
+    if(gForceReadOnly)
     {
-        errorDesc["message"] = "Given database provider is not supported";
+        // a second statement could end the read only transaction or turn the setting off
+        mbase::sql_statement_info statementInfo;
+        mbase::sql_inspect_statement(in_sql, statementInfo);
+        if(!statementInfo.bIsReadOnly)
+        {
+            out_status = send_error(in_req, in_resp, NLQ_QUERY_NOT_READ_ONLY, in_sql);
+            return false;
+        }
     }
 
-    else if(in_status_code == NLQ_DB_ERR)
+    mbase::nlq_cost_estimate costEstimate;
+    mbase::I32 outputCode;
+    if(!mbase::psql_apply_exec_limits(in_connection, in_limits, outputCode))
     {
-        errorDesc["message"] = "Database failed to execute the generated query";
+        out_status = send_error(in_req, in_resp, outputCode, in_sql);
+        return false;
     }
 
-    else if(in_status_code == NLQ_INPUT_TOO_LONG)
+    if(mbase::psql_check_query_cost(in_connection, in_sql, in_max_rows, costEstimate, outputCode, out_error))
     {
-        errorDesc["message"] = "Given prompt is too long. This may also happen if the provided sql_history is too long";
+        return true;
     }
 
-    else if(in_status_code == NLQ_TOO_MUCH_DATA)
+    if(outputCode != NLQ_QUERY_TOO_EXPENSIVE)
     {
-        errorDesc["message"] = "Too much data returned from the database";
+        if(out_error && outputCode == NLQ_DB_ERR && mbase::psql_is_repairable(*out_error))
+        {
+            out_status = outputCode;
+            return false;
+        }
+        out_status = send_error(in_req, in_resp, outputCode, in_sql);
+        return false;
     }
 
-    if(in_data.size())
+    mbase::Json responseJson;
+    out_status = gCostGuardAction == "generate" ? NLQ_SUCCESS : outputCode;
+    if(gCostGuardAction == "generate")
     {
-        errorDesc["data"] = in_data;
+        responseJson["status"] = NLQ_SUCCESS;
+        responseJson["sql"] = in_sql;
+        responseJson["executed"] = false;
     }
+    else
+    {
+        responseJson["status"] = outputCode;
+        responseJson["message"] = nlq_status_message(outputCode);
+        responseJson["data"] = in_sql;
+    }
+    responseJson["estimate"]["cost"] = costEstimate.mTotalCost;
+    responseJson["estimate"]["rows"] = costEstimate.mPlanRows;
 
-    mbase::string outputString = errorDesc.toString();
+    mbase::string outputString = responseJson.toString();
     in_resp.set_content(outputString.c_str(), outputString.size(), "application/json");
+    return false;
 }
 
-void nlquery_endpoint(const httplib::Request& in_req, httplib::Response& in_resp)
+// Null if the database isn't served by this process
+nlq_database* find_database(const mbase::string& in_name)
 {
-    mbase::string reqBody(in_req.body.c_str(), in_req.body.size());
-    std::pair<mbase::Json::Status, mbase::Json> parseResult = mbase::Json::parse(reqBody);
-
-    if(gApiKey.size())
+    for(nlq_database* activeDatabase : gDatabases)
     {
-        if(!in_req.has_header("Authorization"))
-        { 
-            in_resp.status = 401;
-            return;
-        }
-        
-        std::string authToken = in_req.get_header_value("Authorization");
-        mbase::string authTokenField(authToken.c_str(), authToken.size());
-        mbase::vector<mbase::string> seperatedField;
-
-        authTokenField.split(" ", seperatedField);
-        if(seperatedField.size() != 2) // 'Bearer' and 'key'
+        if(activeDatabase->mName == in_name)
         {
-            in_resp.status = 401;
-            return;
+            return activeDatabase;
         }
+    }
+    return nullptr;
+}
 
-        mbase::string bearerString = seperatedField[0];
+/*
+    Generates the SQL of in_prompt, unless io_generated_sql already holds the SQL an earlier attempt of the same job generated.
+    The generated SQL is left in io_generated_sql.
+*/
+bool generate_sql(mbase::PostgrePooledConnection* in_connection, nlq_database* in_database, const mbase::string& in_prompt, mbase::string* io_generated_sql, mbase::string& out_sql, mbase::I32& out_status)
+{
+    if(io_generated_sql && io_generated_sql->size())
+    {
+        out_sql = *io_generated_sql;
+        return true;
+    }
 
-        if(bearerString != "Bearer")
-        {
-            in_resp.status = 401;
-            return;
-        }
+    if(!mbase::psql_generate_sql(in_connection, gGlobalModel, in_database, in_prompt, out_sql, out_status))
+    {
+        return false;
+    }
 
-        if(seperatedField[1] != gApiKey)
-        {
-            in_resp.status = 403;
-            return;
-        }
+    if(io_generated_sql)
+    {
+        *io_generated_sql = out_sql;
+    }
+    return true;
+}
+
+/*
+    Reads were started on a replica before the SQL was known. Anything that turns out to write is moved to the primary,
+    and so is a read whose replica didn't come up, or that the replica refused (in_force_primary). false means the response is already set, with out_status in it.
+*/
+bool route_connection(
+    const httplib::Request& in_req,
+    httplib::Response& in_resp,
+    std::unique_ptr<mbase::PostgrePooledConnection>& io_connection,
+    const mbase::string& in_sql,
+    const mbase::string& in_hostname,
+    const mbase::I32& in_port,
+    const mbase::string& in_dbname,
+    const mbase::string& in_username,
+    const mbase::string& in_password,
+    mbase::I32& out_status,
+    bool in_force_primary = false
+)
+{
+    if(!io_connection->isReplica())
+    {
+        return true;
+    }
+
+    mbase::sql_statement_info statementInfo;
+    mbase::sql_inspect_statement(in_sql, statementInfo);
+    if(statementInfo.bIsReadOnly && !in_force_primary && io_connection->wait_connected())
+    {
+        return true;
+    }
+
+    io_connection = std::make_unique<mbase::PostgrePooledConnection>(in_hostname, in_port, in_dbname, in_username, in_password);
+    if(io_connection->isOverloaded())
+    {
+        out_status = send_error(in_req, in_resp, NLQ_ENGINE_OVERLOADED);
+        return false;
+    }
+
+    if(!io_connection->get_connection_ptr())
+    {
+        out_status = send_error(in_req, in_resp, NLQ_CONNECTION_FAILED);
+        return false;
+    }
+    return true;
+}
+
+/*
+    The /nlquery handler, returns the status it answered with.
+    io_generated_sql is given by the job workers. The SQL generated by the call is left in it, and if it isn't empty
+    on the way in, it is executed without decoding again; a job retried after the database was overloaded keeps its SQL.
+*/
+mbase::I32 nlquery_process(const httplib::Request& in_req, httplib::Response& in_resp, mbase::string* io_generated_sql = nullptr)
+{
+    std::chrono::steady_clock::time_point requestStart = std::chrono::steady_clock::now();
+
+    // everything that doesn't outlive the handler is allocated from here
+    mbase::NlqRequestArena requestArena;
+    std::pmr::memory_resource* arenaResource = requestArena.get_resource();
+
+    if(!check_authorization(in_req, in_resp))
+    {
+        return NLQ_INVALID_PAYLOAD;
     }
 
+    // unauthorized requests are rejected before the body is parsed
+    mbase::string reqBody(in_req.body.c_str(), in_req.body.size());
+    std::pair<mbase::Json::Status, mbase::Json> parseResult = mbase::Json::parse(reqBody);
+
     if(parseResult.first != mbase::Json::Status::success)
     {
-        send_error(in_req, in_resp, NLQ_INVALID_PAYLOAD);
-        return;
+        return send_error(in_req, in_resp, NLQ_INVALID_PAYLOAD);
     }
 
-    mbase::string databaseName = gDBName;
+    nlq_database* activeDatabase = gDatabases[0];
     mbase::string provider = gDBProvider;
     mbase::string userName;
     mbase::string password;
@@ -171,14 +377,22 @@ void nlquery_endpoint(const httplib::Request& in_req, httplib::Response& in_resp
     
     if(!givenJson["query"].isString())
     {
-        send_error(in_req, in_resp, NLQ_INVALID_PAYLOAD);
-        return;
+        return send_error(in_req, in_resp, NLQ_INVALID_PAYLOAD);
+    }
+
+    if(givenJson["database"].isString())
+    {
+        activeDatabase = find_database(givenJson["database"].getString());
+        if(!activeDatabase)
+        {
+            return send_error(in_req, in_resp, NLQ_DATABASE_NOT_FOUND);
+        }
     }
+    const mbase::string& databaseName = activeDatabase->mName;
 
     if(gForceCredentials && (!givenJson["db_username"].isString() || !givenJson["db_password"].isString()))
     {
-        send_error(in_req, in_resp, NLQ_CONNECTION_FAILED);
-        return;
+        return send_error(in_req, in_resp, NLQ_CONNECTION_FAILED);
     }
 
     if(givenJson["db_username"].isString())
@@ -192,7 +406,7 @@ void nlquery_endpoint(const httplib::Request& in_req, httplib::Response& in_resp
     }
 
     mbase::string query = givenJson["query"].getString();
-    mbase::string sqlHistory;
+    std::pmr::string sqlHistory(arenaResource);
     bool genOnly = true;
     if(givenJson["sql_history"].isArray())
     {
@@ -201,7 +415,18 @@ void nlquery_endpoint(const httplib::Request& in_req, httplib::Response& in_resp
         {
             if(sqlHistoryItem["query_old"].isString() && sqlHistoryItem["sql"].isString())
             {
-                sqlHistory +=  mbase::string::from_format("NLQ-%d: ", historyCounter) + sqlHistoryItem["query_old"].getString() + '=' + sqlHistoryItem["sql"].getString() + '\n';
+                const mbase::string& oldQuery = sqlHistoryItem["query_old"].getString();
+                const mbase::string& oldSql = sqlHistoryItem["sql"].getString();
+                char counterBuffer[16];
+                std::to_chars_result convResult = std::to_chars(counterBuffer, counterBuffer + sizeof(counterBuffer), historyCounter);
+
+                sqlHistory += "NLQ-";
+                sqlHistory.append(counterBuffer, convResult.ptr - counterBuffer);
+                sqlHistory += ": ";
+                sqlHistory.append(oldQuery.c_str(), oldQuery.size());
+                sqlHistory += '=';
+                sqlHistory.append(oldSql.c_str(), oldSql.size());
+                sqlHistory += '\n';
                 historyCounter++;
             }
         }
@@ -212,43 +437,589 @@ void nlquery_endpoint(const httplib::Request& in_req, httplib::Response& in_resp
         genOnly = givenJson["generate_only"].getBool();
     }
 
+    // chunked responses, NDJSON and arrow are negotiated through the Accept header
+    std::string acceptHeader = in_req.get_header_value("Accept");
+    mbase::nlq_output_options outputOptions;
+    outputOptions.bIsArrow = acceptHeader.find(NLQ_ARROW_CONTENT_TYPE) != std::string::npos;
+    bool isNdjson = !outputOptions.bIsArrow && acceptHeader.find("application/x-ndjson") != std::string::npos;
+    bool isStream = isNdjson;
+
+    // CSV exports always execute the query and have their own, higher limits
+    bool isExport = acceptHeader.find("text/csv") != std::string::npos;
+    if(givenJson["export"].isString())
+    {
+        isExport = givenJson["export"].getString() == "csv";
+    }
+
+    if(isExport)
+    {
+        genOnly = false;
+    }
+    if(givenJson["stream"].isBool())
+    {
+        isStream = isNdjson || (!outputOptions.bIsArrow && givenJson["stream"].getBool());
+    }
+
+    if(givenJson["dict_encode"].isBool())
+    {
+        outputOptions.bIsDictEncoded = givenJson["dict_encode"].getBool();
+    }
+
+    // pages of gMaxRows rows through a server side cursor instead of failing with too much data
+    bool isPaginated = false;
+    if(givenJson["paginate"].isBool())
+    {
+        isPaginated = givenJson["paginate"].getBool();
+    }
+
+    mbase::nlq_content_encoding responseEncoding = mbase::nlq_negotiate_encoding(in_req.get_header_value("Accept-Encoding"));
+    in_resp.set_header("Vary", "Accept-Encoding");
+
+    mbase::I32 maxRows = isExport ? gExportMaxRows : gMaxRows;
+    if(givenJson["max_rows"].isLong())
+    {
+        // clients may only lower the server limit
+        mbase::I64 requestedRows = givenJson["max_rows"].getLong();
+        if(requestedRows > 0 && requestedRows < maxRows)
+        {
+            maxRows = (mbase::I32)requestedRows;
+        }
+    }
+
+    // like max_rows, the timeouts can only be lowered by the client
+    mbase::psql_exec_limits execLimits;
+    execLimits.mStatementTimeout = gStatementTimeout;
+    execLimits.mLockTimeout = gLockTimeout;
+    if(givenJson["statement_timeout"].isLong())
+    {
+        mbase::I64 requestedTimeout = givenJson["statement_timeout"].getLong();
+        if(requestedTimeout > 0 && (!gStatementTimeout || requestedTimeout < gStatementTimeout))
+        {
+            execLimits.mStatementTimeout = (mbase::I32)requestedTimeout;
+        }
+    }
+
+    if(givenJson["lock_timeout"].isLong())
+    {
+        mbase::I64 requestedTimeout = givenJson["lock_timeout"].getLong();
+        if(requestedTimeout > 0 && (!gLockTimeout || requestedTimeout < gLockTimeout))
+        {
+            execLimits.mLockTimeout = (mbase::I32)requestedTimeout;
+        }
+    }
+
+    // failed statements are sent back to the model with the database error, the client may only lower the attempt count
+    mbase::I32 maxRepairs = gMaxRepairs;
+    if(givenJson["max_repairs"].isLong())
+    {
+        mbase::I64 requestedRepairs = givenJson["max_repairs"].getLong();
+        if(requestedRepairs >= 0 && requestedRepairs < maxRepairs)
+        {
+            maxRepairs = (mbase::I32)requestedRepairs;
+        }
+    }
+
     if(!databaseName.size() || !provider.size() || !userName.size() || !hostname.size() || !query.size() || hostPort <= 0)
     {
-        send_error(in_req, in_resp, NLQ_INVALID_PAYLOAD);
-        return;
+        return send_error(in_req, in_resp, NLQ_INVALID_PAYLOAD);
     }
     
     provider.to_lower();
 
     if(provider == "postgresql")
     {
-        mbase::PostgreSafeConnect postgreConnector(hostname, hostPort, databaseName, userName, password);
-        
-        if(!postgreConnector.isConnected()) // connection bad? monke sad.
+        // generate only requests never touch the database, execute requests connect while the model decodes.
+        // Most generated queries are reads, so with replicas the connection is started on one of them.
+        std::unique_ptr<mbase::PostgrePooledConnection> postgreConnector;
+        if(!genOnly)
         {
-            send_error(in_req, in_resp, NLQ_CONNECTION_FAILED);
-            return;
+            postgreConnector = mbase::psql_connect_routed(hostname, hostPort, databaseName, userName, password, mbase::gPostgreReplicaSet.size() > 0);
+            if(postgreConnector->isOverloaded())
+            {
+                return send_error(in_req, in_resp, NLQ_ENGINE_OVERLOADED);
+            }
+
+            if(!postgreConnector->get_connection_ptr()) // connection bad? monke sad.
+            {
+                return send_error(in_req, in_resp, NLQ_CONNECTION_FAILED);
+            }
+        }
+
+        mbase::string formedString = mbase::prepare_nlquery_prompt(sqlHistory, std::string_view(query.c_str(), query.size()), arenaResource);
+        if(isExport)
+        {
+            mbase::I32 outputCode;
+            mbase::string generatedSql;
+            if(!generate_sql(postgreConnector.get(), activeDatabase, formedString, io_generated_sql, generatedSql, outputCode))
+            {
+                return send_error(in_req, in_resp, outputCode);
+            }
+
+            if(!route_connection(in_req, in_resp, postgreConnector, generatedSql, hostname, hostPort, databaseName, userName, password, outputCode))
+            {
+                return outputCode;
+            }
+
+            if(!prepare_execution(in_req, in_resp, postgreConnector.get(), generatedSql, maxRows, execLimits, outputCode))
+            {
+                return outputCode;
+            }
+
+            if(!mbase::psql_start_copy(postgreConnector.get(), generatedSql, maxRows, outputCode))
+            {
+                return send_error(in_req, in_resp, outputCode, generatedSql);
+            }
+
+            std::shared_ptr<mbase::PsqlCopyStream> copyStream = std::make_shared<mbase::PsqlCopyStream>(std::move(postgreConnector), maxRows, (mbase::I64)gExportMaxMegabytes * 1024 * 1024);
+            in_resp.set_header("Content-Disposition", "attachment; filename=\"nlquery.csv\"");
+            in_resp.set_header("Trailer", "X-NLQuery-Status");
+            set_chunked_body(in_resp, "text/csv", responseEncoding, copyStream);
+            return NLQ_SUCCESS;
+        }
+
+        if(!genOnly && isStream)
+        {
+            mbase::I32 outputCode;
+            mbase::string generatedSql;
+            if(!generate_sql(postgreConnector.get(), activeDatabase, formedString, io_generated_sql, generatedSql, outputCode))
+            {
+                return send_error(in_req, in_resp, outputCode);
+            }
+
+            if(!route_connection(in_req, in_resp, postgreConnector, generatedSql, hostname, hostPort, databaseName, userName, password, outputCode))
+            {
+                return outputCode;
+            }
+
+            if(!prepare_execution(in_req, in_resp, postgreConnector.get(), generatedSql, maxRows, execLimits, outputCode))
+            {
+                return outputCode;
+            }
+
+            if(!mbase::psql_start_query(postgreConnector.get(), generatedSql, maxRows, outputCode))
+            {
+                return send_error(in_req, in_resp, outputCode, generatedSql);
+            }
+
+            // the stream owns the connection from now on
+            mbase::PsqlResultStream::stream_format streamFormat = isNdjson ? mbase::PsqlResultStream::stream_format::NDJSON : mbase::PsqlResultStream::stream_format::JSON;
+            std::shared_ptr<mbase::PsqlResultStream> resultStream = std::make_shared<mbase::PsqlResultStream>(std::move(postgreConnector), generatedSql, maxRows, streamFormat, outputOptions);
+            set_chunked_body(in_resp, isNdjson ? "application/x-ndjson" : "application/json", responseEncoding, resultStream);
+            return NLQ_SUCCESS;
+        }
+
+        if(!genOnly && isPaginated)
+        {
+            // checked before the generation so that a full registry doesn't waste the inference
+            if(!mbase::gPsqlCursorRegistry.reserve())
+            {
+                return send_error(in_req, in_resp, NLQ_ENGINE_OVERLOADED);
+            }
+
+            mbase::I32 outputCode;
+            mbase::string generatedSql;
+            if(!generate_sql(postgreConnector.get(), activeDatabase, formedString, io_generated_sql, generatedSql, outputCode))
+            {
+                mbase::gPsqlCursorRegistry.unreserve();
+                return send_error(in_req, in_resp, outputCode);
+            }
+
+            if(!route_connection(in_req, in_resp, postgreConnector, generatedSql, hostname, hostPort, databaseName, userName, password, outputCode))
+            {
+                mbase::gPsqlCursorRegistry.unreserve();
+                return outputCode;
+            }
+
+            if(!prepare_execution(in_req, in_resp, postgreConnector.get(), generatedSql, 0, execLimits, outputCode))
+            {
+                mbase::gPsqlCursorRegistry.unreserve();
+                return outputCode;
+            }
+
+            mbase::sql_statement_info statementInfo;
+            mbase::sql_inspect_statement(generatedSql, statementInfo);
+            if(!statementInfo.bIsReadOnly)
+            {
+                // modifying statements have nothing to page through
+                mbase::gPsqlCursorRegistry.unreserve();
+                std::string responseBody;
+                const char* contentType = NULL;
+                if(!mbase::psql_execute_output(postgreConnector.get(), generatedSql, outputOptions, maxRows, arenaResource, responseBody, contentType, outputCode))
+                {
+                    return send_error(in_req, in_resp, outputCode, generatedSql);
+                }
+                send_body(in_resp, std::move(responseBody), contentType, responseEncoding);
+                return NLQ_SUCCESS;
+            }
+
+            mbase::I32 resultFormat = 0;
+            if(!mbase::psql_open_cursor(postgreConnector.get(), statementInfo, resultFormat, outputCode))
+            {
+                mbase::gPsqlCursorRegistry.unreserve();
+                return send_error(in_req, in_resp, outputCode, generatedSql);
+            }
+
+            std::shared_ptr<mbase::PsqlCursor> queryCursor = std::make_shared<mbase::PsqlCursor>(std::move(postgreConnector), maxRows, resultFormat, outputOptions);
+            mbase::PsqlResultBuffer pageRows;
+            if(!queryCursor->fetch_page(pageRows, outputCode))
+            {
+                mbase::gPsqlCursorRegistry.unreserve();
+                return send_error(in_req, in_resp, outputCode, generatedSql);
+            }
+
+            // a short page means the cursor is exhausted, it is closed with the handler
+            mbase::string cursorToken;
+            if(pageRows.get_row_count() == maxRows)
+            {
+                cursorToken = mbase::gPsqlCursorRegistry.register_cursor(queryCursor);
+            }
+            else
+            {
+                mbase::gPsqlCursorRegistry.unreserve();
+            }
+
+            std::string responseBody;
+            mbase::nlq_write_json_page(responseBody, &generatedSql, pageRows, cursorToken, outputOptions, arenaResource);
+            send_body(in_resp, std::move(responseBody), "application/json", responseEncoding);
+            return NLQ_SUCCESS;
+        }
+
+        if(!genOnly && maxRepairs > 0)
+        {
+            // the processor is kept until the query succeeds, a rejected statement is corrected in the context it was generated in
+            mbase::NlqProcessorLease processorLease(gGlobalModel, *activeDatabase);
+            if(!processorLease.get())
+            {
+                return send_error(in_req, in_resp, NLQ_ENGINE_OVERLOADED);
+            }
+
+            mbase::context_line repairContext[3];
+            repairContext[0].mRole = mbase::context_role::USER;
+            repairContext[0].mMessage = formedString;
+            repairContext[1].mRole = mbase::context_role::ASSISTANT;
+            repairContext[2].mRole = mbase::context_role::USER;
+
+            mbase::I32 outputCode;
+            mbase::string generatedSql;
+            if(io_generated_sql && io_generated_sql->size())
+            {
+                generatedSql = *io_generated_sql;
+            }
+
+            else if(!mbase::psql_decode_sql(postgreConnector.get(), processorLease.get(), repairContext, 1, generatedSql, outputCode))
+            {
+                return send_error(in_req, in_resp, outputCode);
+            }
+
+            else if(io_generated_sql)
+            {
+                *io_generated_sql = generatedSql;
+            }
+
+            std::string responseBody;
+            const char* contentType = NULL;
+            mbase::psql_error_info dbError;
+            mbase::I32 repairCount = 0;
+            bool isPrimaryForced = false;
+            while(1)
+            {
+                if(!route_connection(in_req, in_resp, postgreConnector, generatedSql, hostname, hostPort, databaseName, userName, password, outputCode, isPrimaryForced))
+                {
+                    return outputCode;
+                }
+
+                // a statement the planner rejects during the cost check is repaired like one rejected at execution
+                dbError = mbase::psql_error_info();
+                if(!prepare_execution(in_req, in_resp, postgreConnector.get(), generatedSql, maxRows, execLimits, outputCode, &dbError))
+                {
+                    if(!mbase::psql_is_repairable(dbError))
+                    {
+                        return outputCode;
+                    }
+                    outputCode = NLQ_DB_ERR;
+                }
+
+                else if(mbase::psql_execute_output(postgreConnector.get(), generatedSql, outputOptions, maxRows, arenaResource, responseBody, contentType, outputCode, &dbError))
+                {
+                    break;
+                }
+
+                else if(postgreConnector->isReplica() && mbase::psql_is_read_only_violation(dbError))
+                {
+                    // the statement writes after all, it is run on the primary as it is
+                    isPrimaryForced = true;
+                    continue;
+                }
+
+                mbase::I64 elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - requestStart).count();
+                if(outputCode != NLQ_DB_ERR || repairCount >= maxRepairs || elapsedMs >= gRepairDeadline || !mbase::psql_is_repairable(dbError))
+                {
+                    return send_error(in_req, in_resp, outputCode, generatedSql);
+                }
+
+                // only the last attempt is shown to the model, the prompt doesn't grow with the attempts
+                repairContext[1].mMessage = generatedSql;
+                repairContext[2].mMessage = mbase::prepare_repair_prompt(dbError.mMessage);
+                if(!mbase::psql_decode_sql(nullptr, processorLease.get(), repairContext, 3, generatedSql, outputCode))
+                {
+                    return send_error(in_req, in_resp, outputCode, repairContext[1].mMessage);
+                }
+
+                if(io_generated_sql)
+                {
+                    *io_generated_sql = generatedSql;
+                }
+                ++repairCount;
+            }
+
+            in_resp.set_header("X-NLQuery-Repairs", std::to_string(repairCount));
+            send_body(in_resp, std::move(responseBody), contentType, responseEncoding);
+            return NLQ_SUCCESS;
         }
 
-        mbase::string formedString = mbase::prepare_nlquery_prompt(sqlHistory, query);
-        mbase::Json outputJson;
         mbase::I32 outputCode;
         mbase::string generatedSql;
-        if(!mbase::psql_produce_output(postgreConnector.get_connection_ptr(), gGlobalModel, genOnly, formedString, sqlHistory, outputJson, outputCode, generatedSql))
+        if(!generate_sql(postgreConnector.get(), activeDatabase, formedString, io_generated_sql, generatedSql, outputCode))
         {
-            send_error(in_req, in_resp, outputCode, generatedSql);
+            return send_error(in_req, in_resp, outputCode);
+        }
+
+        // generate only requests and modifying queries have no result set, they are answered in JSON regardless of the output options
+        std::string responseBody;
+        const char* contentType = "application/json";
+        if(genOnly)
+        {
+            mbase::nlq_write_json_response(responseBody, generatedSql, nullptr, outputOptions, arenaResource);
+        }
+        else
+        {
+            if(!route_connection(in_req, in_resp, postgreConnector, generatedSql, hostname, hostPort, databaseName, userName, password, outputCode))
+            {
+                return outputCode;
+            }
+
+            if(!prepare_execution(in_req, in_resp, postgreConnector.get(), generatedSql, maxRows, execLimits, outputCode))
+            {
+                return outputCode;
+            }
+
+            mbase::psql_error_info dbError;
+            bool isExecuted = mbase::psql_execute_output(postgreConnector.get(), generatedSql, outputOptions, maxRows, arenaResource, responseBody, contentType, outputCode, &dbError);
+            if(!isExecuted && postgreConnector->isReplica() && mbase::psql_is_read_only_violation(dbError))
+            {
+                // the statement writes after all, the replica refused it
+                if(!route_connection(in_req, in_resp, postgreConnector, generatedSql, hostname, hostPort, databaseName, userName, password, outputCode, true))
+                {
+                    return outputCode;
+                }
+
+                if(!prepare_execution(in_req, in_resp, postgreConnector.get(), generatedSql, maxRows, execLimits, outputCode))
+                {
+                    return outputCode;
+                }
+                responseBody.clear();
+                isExecuted = mbase::psql_execute_output(postgreConnector.get(), generatedSql, outputOptions, maxRows, arenaResource, responseBody, contentType, outputCode);
+            }
+
+            if(!isExecuted)
+            {
+                return send_error(in_req, in_resp, outputCode, generatedSql);
+            }
+        }
+        send_body(in_resp, std::move(responseBody), contentType, responseEncoding);
+        return NLQ_SUCCESS;
+    }
+
+    else
+    {
+        return send_error(in_req, in_resp, NLQ_NOT_SUPPORTED);
+    }
+}
+
+void nlquery_endpoint(const httplib::Request& in_req, httplib::Response& in_resp)
+{
+    nlquery_process(in_req, in_resp);
+}
+
+// Next page of a cursor opened by a paginated /nlquery call, no generation involved
+void nlquery_next_endpoint(const httplib::Request& in_req, httplib::Response& in_resp)
+{
+    mbase::NlqRequestArena requestArena;
+    if(!check_authorization(in_req, in_resp))
+    {
+        return;
+    }
+
+    mbase::string reqBody(in_req.body.c_str(), in_req.body.size());
+    std::pair<mbase::Json::Status, mbase::Json> parseResult = mbase::Json::parse(reqBody);
+    if(parseResult.first != mbase::Json::Status::success || !parseResult.second["next_token"].isString())
+    {
+        send_error(in_req, in_resp, NLQ_INVALID_PAYLOAD);
+        return;
+    }
+
+    mbase::string cursorToken = parseResult.second["next_token"].getString();
+    std::shared_ptr<mbase::PsqlCursor> queryCursor = mbase::gPsqlCursorRegistry.acquire(cursorToken);
+    if(!queryCursor)
+    {
+        send_error(in_req, in_resp, NLQ_CURSOR_NOT_FOUND);
+        return;
+    }
+
+    mbase::PsqlResultBuffer pageRows;
+    mbase::I32 outputCode;
+    if(!queryCursor->fetch_page(pageRows, outputCode))
+    {
+        mbase::gPsqlCursorRegistry.release(cursorToken, true);
+        send_error(in_req, in_resp, outputCode);
+        return;
+    }
+
+    bool isExhausted = pageRows.get_row_count() < queryCursor->get_page_size();
+    std::string responseBody;
+    mbase::nlq_write_json_page(responseBody, nullptr, pageRows, isExhausted ? mbase::string() : cursorToken, queryCursor->get_options(), requestArena.get_resource());
+    mbase::gPsqlCursorRegistry.release(cursorToken, isExhausted);
+
+    in_resp.set_header("Vary", "Accept-Encoding");
+    send_body(in_resp, std::move(responseBody), "application/json", mbase::nlq_negotiate_encoding(in_req.get_header_value("Accept-Encoding")));
+}
+
+/*
+    Queues an /nlquery request and answers with its job id right away. The request is checked as far as it can be
+    without running it; jobs are answered in one piece, so streamed and exported results are not available.
+*/
+void nlquery_jobs_endpoint(const httplib::Request& in_req, httplib::Response& in_resp)
+{
+    if(!check_authorization(in_req, in_resp))
+    {
+        return;
+    }
+
+    mbase::string reqBody(in_req.body.c_str(), in_req.body.size());
+    std::pair<mbase::Json::Status, mbase::Json> parseResult = mbase::Json::parse(reqBody);
+    if(parseResult.first != mbase::Json::Status::success || !parseResult.second["query"].isString())
+    {
+        send_error(in_req, in_resp, NLQ_INVALID_PAYLOAD);
+        return;
+    }
+
+    mbase::Json& givenJson = parseResult.second;
+    std::string acceptHeader = in_req.get_header_value("Accept");
+    bool isStream = givenJson["stream"].isBool() && givenJson["stream"].getBool();
+    if(isStream || givenJson["export"].isString() || acceptHeader.find("application/x-ndjson") != std::string::npos || acceptHeader.find("text/csv") != std::string::npos)
+    {
+        send_error(in_req, in_resp, NLQ_INVALID_PAYLOAD);
+        return;
+    }
+
+    nlq_database* activeDatabase = gDatabases[0];
+    if(givenJson["database"].isString())
+    {
+        activeDatabase = find_database(givenJson["database"].getString());
+        if(!activeDatabase)
+        {
+            send_error(in_req, in_resp, NLQ_DATABASE_NOT_FOUND);
             return;
         }
-        mbase::string outputString = outputJson.toString();
+    }
+
+    // arrow is the only format negotiated through the Accept header that a job can produce
+    std::string jobAccept = acceptHeader.find(NLQ_ARROW_CONTENT_TYPE) != std::string::npos ? NLQ_ARROW_CONTENT_TYPE : "";
+    std::shared_ptr<mbase::NlqJob> newJob = std::make_shared<mbase::NlqJob>(activeDatabase, in_req.body, in_req.get_header_value("Authorization"), jobAccept);
+    mbase::string jobId = mbase::gNlqJobRegistry.submit(newJob);
+    if(!jobId.size())
+    {
+        send_error(in_req, in_resp, NLQ_ENGINE_OVERLOADED);
+        return;
+    }
+
+    mbase::Json responseJson;
+    responseJson["status"] = NLQ_SUCCESS;
+    responseJson["job_id"] = jobId;
+    responseJson["state"] = mbase::nlq_job_state_name(mbase::NlqJob::job_state::QUEUED);
+    mbase::string outputString = responseJson.toString();
+    in_resp.status = 202;
+    in_resp.set_content(outputString.c_str(), outputString.size(), "application/json");
+}
+
+// The state of a job, or once it is done, the response /nlquery would have sent
+void nlquery_job_status_endpoint(const httplib::Request& in_req, httplib::Response& in_resp)
+{
+    if(!check_authorization(in_req, in_resp))
+    {
+        return;
+    }
+
+    mbase::string jobId = in_req.path_params.at("id").c_str();
+    mbase::NlqJob::job_state jobState;
+    std::shared_ptr<const mbase::nlq_job_result> jobResult;
+    if(!mbase::gNlqJobRegistry.lookup(jobId, jobState, jobResult))
+    {
+        send_error(in_req, in_resp, NLQ_JOB_NOT_FOUND);
+        return;
+    }
+
+    if(jobState != mbase::NlqJob::job_state::DONE)
+    {
+        mbase::Json responseJson;
+        responseJson["status"] = NLQ_SUCCESS;
+        responseJson["job_id"] = jobId;
+        responseJson["state"] = mbase::nlq_job_state_name(jobState);
+        mbase::string outputString = responseJson.toString();
+        in_resp.status = 202;
         in_resp.set_content(outputString.c_str(), outputString.size(), "application/json");
         return;
     }
 
-    else
+    // the result is kept until it expires, it is copied so that it can be read more than once
+    in_resp.status = jobResult->mHttpStatus;
+    for(const std::pair<std::string, std::string>& resultHeader : jobResult->mHeaders)
+    {
+        in_resp.set_header(resultHeader.first, resultHeader.second);
+    }
+    in_resp.set_header("Vary", "Accept-Encoding");
+    send_body(in_resp, std::string(jobResult->mBody), jobResult->mContentType.c_str(), mbase::nlq_negotiate_encoding(in_req.get_header_value("Accept-Encoding")));
+}
+
+// Rebuilds the schema and the processors in the background, the request returns right away
+void schema_refresh_endpoint(const httplib::Request& in_req, httplib::Response& in_resp)
+{
+    if(!check_authorization(in_req, in_resp))
     {
-        send_error(in_req, in_resp, NLQ_NOT_SUPPORTED);
         return;
     }
+
+    // an empty body refreshes every database
+    if(in_req.body.size())
+    {
+        mbase::string reqBody(in_req.body.c_str(), in_req.body.size());
+        std::pair<mbase::Json::Status, mbase::Json> parseResult = mbase::Json::parse(reqBody);
+        if(parseResult.first != mbase::Json::Status::success || !parseResult.second["database"].isString())
+        {
+            send_error(in_req, in_resp, NLQ_INVALID_PAYLOAD);
+            return;
+        }
+
+        nlq_database* activeDatabase = find_database(parseResult.second["database"].getString());
+        if(!activeDatabase)
+        {
+            send_error(in_req, in_resp, NLQ_DATABASE_NOT_FOUND);
+            return;
+        }
+        activeDatabase->bIsSchemaRefreshRequested = true;
+    }
+    else
+    {
+        for(nlq_database* activeDatabase : gDatabases)
+        {
+            activeDatabase->bIsSchemaRefreshRequested = true;
+        }
+    }
+
+    std::string responseBody = "{";
+    mbase::nlq_write_json_status(responseBody, NLQ_SUCCESS);
+    responseBody += "}";
+    in_resp.set_content(std::move(responseBody), "application/json");
 }
 
 void server_thread()
@@ -275,6 +1046,10 @@ void server_thread()
         svr->set_mount_point("/", webPath.c_str());
     }
     svr->Post("/nlquery", nlquery_endpoint);
+    svr->Post("/nlquery/next", nlquery_next_endpoint);
+    svr->Post("/schema/refresh", schema_refresh_endpoint);
+    svr->Post("/nlquery/jobs", nlquery_jobs_endpoint);
+    svr->Get("/nlquery/jobs/:id", nlquery_job_status_endpoint);
     printf("\nServer started listening.\n\n");
     mbase::string protocolString = "http://";
     if(gSSLEnabled)
@@ -295,6 +1070,155 @@ void server_thread()
     exit(1);
 }
 
+void db_maintenance_thread()
+{
+    mbase::I32 secondsSinceCheck = 0;
+    while(1)
+    {
+        mbase::gPostgreConnectionPool.evict_idle();
+        mbase::gPsqlCursorRegistry.reap_idle();
+        mbase::gNlqJobRegistry.reap_expired();
+        if(mbase::gPostgreReplicaSet.size() && ++secondsSinceCheck >= gReplicaHealthInterval)
+        {
+            mbase::gPostgreReplicaSet.check_health(gDatabases[0]->mName, gDBUsername, gDBPassword);
+            secondsSinceCheck = 0;
+        }
+        mbase::sleep(1000);
+    }
+}
+
+void schema_refresh_thread()
+{
+    mbase::I32 secondsSinceCheck = 0;
+    while(1)
+    {
+        mbase::sleep(1000);
+        ++secondsSinceCheck;
+        bool isCheckDue = gSchemaRefreshInterval > 0 && secondsSinceCheck >= gSchemaRefreshInterval;
+        for(nlq_database* activeDatabase : gDatabases)
+        {
+            bool isRequested = activeDatabase->bIsSchemaRefreshRequested.exchange(false);
+            if(isRequested || isCheckDue)
+            {
+                mbase::nlq_refresh_schema(gGlobalModel, *activeDatabase, isRequested);
+            }
+        }
+
+        if(isCheckDue)
+        {
+            secondsSinceCheck = 0;
+        }
+    }
+}
+
+/*
+    Runs queued jobs through the /nlquery handler. The number of workers is fixed at startup, so the number of threads
+    doesn't grow with the number of jobs that are waiting or how long they take.
+*/
+void job_worker_thread()
+{
+    while(1)
+    {
+        std::shared_ptr<mbase::NlqJob> activeJob = mbase::gNlqJobRegistry.wait_next();
+
+        httplib::Request jobReq;
+        jobReq.method = "POST";
+        jobReq.path = "/nlquery";
+        jobReq.body = activeJob->get_request_body();
+        if(activeJob->get_authorization().size())
+        {
+            jobReq.headers.emplace("Authorization", activeJob->get_authorization());
+        }
+
+        if(activeJob->get_accept().size())
+        {
+            jobReq.headers.emplace("Accept", activeJob->get_accept());
+        }
+
+        /*
+            Synchronous requests take the same processors and pooled connections. A job that finds them taken
+            is run again after a while instead of failing as overloaded, for at most --job-retry-timeout seconds.
+            No Accept-Encoding, the body is compressed when it is fetched.
+        */
+        httplib::Response jobResp;
+        mbase::string generatedSql; // an attempt that got past the generation leaves its SQL here for the next one
+        std::chrono::steady_clock::time_point jobStart = std::chrono::steady_clock::now();
+        for(mbase::I32 retryDelay = 10;; retryDelay = std::min(retryDelay * 2, 1000))
+        {
+            jobResp = httplib::Response();
+            if(nlquery_process(jobReq, jobResp, &generatedSql) != NLQ_ENGINE_OVERLOADED)
+            {
+                break;
+            }
+
+            // past the deadline, the job is done with the overload response of its last attempt
+            mbase::I64 waitedMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - jobStart).count();
+            if(waitedMs + retryDelay > (mbase::I64)gJobRetryTimeout * 1000)
+            {
+                break;
+            }
+            mbase::sleep(retryDelay);
+        }
+
+        std::shared_ptr<mbase::nlq_job_result> jobResult = std::make_shared<mbase::nlq_job_result>();
+        jobResult->mHttpStatus = jobResp.status == -1 ? 200 : jobResp.status;
+        jobResult->mContentType = jobResp.get_header_value("Content-Type");
+        if(!jobResult->mContentType.size())
+        {
+            jobResult->mContentType = "application/json";
+        }
+        jobResult->mBody = std::move(jobResp.body);
+        for(const std::pair<const std::string, std::string>& respHeader : jobResp.headers)
+        {
+            if(respHeader.first != "Content-Type" && respHeader.first != "Vary")
+            {
+                jobResult->mHeaders.push_back(respHeader);
+            }
+        }
+        mbase::gNlqJobRegistry.finish(activeJob, jobResult);
+    }
+}
+
+// Runs while the model is being loaded, the schemas are needed only once the model is initialized
+void schema_introspection_thread()
+{
+    for(nlq_database* activeDatabase : gDatabases)
+    {
+        mbase::PostgreSafeConnect postgreConnect(gDBHostname, gDBPort, activeDatabase->mName, gDBUsername, gDBPassword);
+        if(!postgreConnect.isConnected())
+        {
+            printf("FATAL: Unable to connect to PostgreSQL database %s\n", activeDatabase->mName.c_str());
+            gIsSchemaFailed = true;
+            return;
+        }
+
+        // decides whether the metadata cache is still valid, and is the baseline of the schema refresh
+        mbase::psql_get_schema_fingerprint(postgreConnect.get_connection_ptr(), activeDatabase->mSchemaFingerprint);
+        if(!mbase::psql_get_all_tables(postgreConnect.get_connection_ptr(), *activeDatabase, activeDatabase->mSchemaFingerprint))
+        {
+            printf("FATAL: Unable to retrieve schema information from the database %s\n", activeDatabase->mName.c_str());
+            gIsSchemaFailed = true;
+            return;
+        }
+        printf("SUCCESS: Schema information of %s succesfully retrieved!\n", activeDatabase->mName.c_str());
+
+        // the catalog may have changed after the baseline was read, in which case the schema is refreshed once the model is up
+        mbase::string catalogFingerprint;
+        if(!activeDatabase->mSchemaFingerprint.size() || !mbase::psql_get_schema_fingerprint(postgreConnect.get_connection_ptr(), catalogFingerprint) || catalogFingerprint != activeDatabase->mSchemaFingerprint)
+        {
+            printf("INFO: Schema of %s may have changed during the startup, it will be refreshed\n", activeDatabase->mName.c_str());
+            activeDatabase->bIsSchemaRefreshRequested = true;
+        }
+
+        if(!gForceCredentials)
+        {
+            mbase::I32 openedConnections = mbase::gPostgreConnectionPool.prewarm(gDBHostname, gDBPort, activeDatabase->mName, gDBUsername, gDBPassword);
+            printf("INFO: %d pooled database connection(s) opened to %s\n", openedConnections, activeDatabase->mName.c_str());
+        }
+    }
+    gIsSchemaRetrieved = true;
+}
+
 int main(int argc, char** argv)
 {       
     if(argc < 2)
@@ -368,6 +1292,21 @@ int main(int argc, char** argv)
         {
             mbase::argument_get<int>::value(i, argc, argv, gMaxRows);
         }
+
+        else if(argumentString == "--export-max-rows")
+        {
+            mbase::argument_get<int>::value(i, argc, argv, gExportMaxRows);
+        }
+
+        else if(argumentString == "--export-max-mb")
+        {
+            mbase::argument_get<int>::value(i, argc, argv, gExportMaxMegabytes);
+        }
+
+        else if(argumentString == "--compress-min-bytes")
+        {
+            mbase::argument_get<int>::value(i, argc, argv, gCompressMinBytes);
+        }
         
         else if(argumentString == "--force-credentials")
         {
@@ -406,7 +1345,9 @@ int main(int argc, char** argv)
 
         else if(argumentString == "--db-name")
         {
-            mbase::argument_get<mbase::string>::value(i, argc, argv, gDBName);
+            mbase::string databaseName;
+            mbase::argument_get<mbase::string>::value(i, argc, argv, databaseName);
+            gDBNames.push_back(databaseName);
         }
 
         else if(argumentString == "--db-username")
@@ -419,6 +1360,103 @@ int main(int argc, char** argv)
             mbase::argument_get<mbase::string>::value(i, argc, argv, gDBPassword);
         }
 
+        else if(argumentString == "--db-pool-min")
+        {
+            mbase::argument_get<int>::value(i, argc, argv, gDBPoolMinSize);
+        }
+
+        else if(argumentString == "--db-pool-max")
+        {
+            mbase::argument_get<int>::value(i, argc, argv, gDBPoolMaxSize);
+        }
+
+        else if(argumentString == "--db-pool-idle-timeout")
+        {
+            mbase::argument_get<int>::value(i, argc, argv, gDBPoolIdleTimeout);
+        }
+
+        else if(argumentString == "--db-replica")
+        {
+            mbase::string replicaAddress;
+            mbase::argument_get<mbase::string>::value(i, argc, argv, replicaAddress);
+            gDBReplicas.push_back(replicaAddress);
+        }
+
+        else if(argumentString == "--replica-health-interval")
+        {
+            mbase::argument_get<int>::value(i, argc, argv, gReplicaHealthInterval);
+        }
+
+        else if(argumentString == "--cursor-max-open")
+        {
+            mbase::argument_get<int>::value(i, argc, argv, gCursorMaxOpen);
+        }
+
+        else if(argumentString == "--cursor-idle-timeout")
+        {
+            mbase::argument_get<int>::value(i, argc, argv, gCursorIdleTimeout);
+        }
+
+        else if(argumentString == "--job-max")
+        {
+            mbase::argument_get<int>::value(i, argc, argv, gJobMaxCount);
+        }
+
+        else if(argumentString == "--job-retention")
+        {
+            mbase::argument_get<int>::value(i, argc, argv, gJobRetention);
+        }
+
+        else if(argumentString == "--job-retry-timeout")
+        {
+            mbase::argument_get<int>::value(i, argc, argv, gJobRetryTimeout);
+        }
+
+        else if(argumentString == "--schema-refresh-interval")
+        {
+            mbase::argument_get<int>::value(i, argc, argv, gSchemaRefreshInterval);
+        }
+
+        else if(argumentString == "--max-query-cost")
+        {
+            mbase::argument_get<int>::value(i, argc, argv, gMaxQueryCost);
+        }
+
+        else if(argumentString == "--max-estimated-rows")
+        {
+            mbase::argument_get<int>::value(i, argc, argv, gMaxEstimatedRows);
+        }
+
+        else if(argumentString == "--cost-guard-action")
+        {
+            mbase::argument_get<mbase::string>::value(i, argc, argv, gCostGuardAction);
+        }
+
+        else if(argumentString == "--statement-timeout")
+        {
+            mbase::argument_get<int>::value(i, argc, argv, gStatementTimeout);
+        }
+
+        else if(argumentString == "--lock-timeout")
+        {
+            mbase::argument_get<int>::value(i, argc, argv, gLockTimeout);
+        }
+
+        else if(argumentString == "--max-repairs")
+        {
+            mbase::argument_get<int>::value(i, argc, argv, gMaxRepairs);
+        }
+
+        else if(argumentString == "--repair-deadline")
+        {
+            mbase::argument_get<int>::value(i, argc, argv, gRepairDeadline);
+        }
+
+        else if(argumentString == "--force-read-only")
+        {
+            gForceReadOnly = true;
+        }
+
         else if(argumentString == "--gpu-layers")
         {
             mbase::argument_get<mbase::I32>::value(i, argc, argv, gNLayers);
@@ -440,12 +1478,58 @@ int main(int argc, char** argv)
         printf("ERR: Port can't be 0\n");
     }
 
+    if(gDBPoolMaxSize <= 0)
+    {
+        gDBPoolMaxSize = gUserCount;
+    }
+
+    if(gDBPoolMinSize > gDBPoolMaxSize)
+    {
+        gDBPoolMinSize = gDBPoolMaxSize;
+    }
+
+    // every open cursor holds a pooled connection, keep one free for the other queries
+    if(gCursorMaxOpen >= gDBPoolMaxSize)
+    {
+        gCursorMaxOpen = gDBPoolMaxSize - 1;
+        printf("WARN: Cursor max open is lowered to %d to stay below the pool max size\n", gCursorMaxOpen);
+    }
+
+    for(const mbase::string& databaseName : gDBNames)
+    {
+        if(!find_database(databaseName))
+        {
+            nlq_database* newDatabase = new nlq_database; // lives as long as the program
+            newDatabase->mName = databaseName;
+            gDatabases.push_back(newDatabase);
+        }
+    }
+
+    for(const mbase::string& replicaAddress : gDBReplicas)
+    {
+        // host or host:port, the port defaults to the one of the primary
+        std::string_view addressView(replicaAddress.c_str(), replicaAddress.size());
+        size_t portSeparator = addressView.rfind(':');
+        mbase::I32 replicaPort = gDBPort;
+        if(portSeparator != std::string_view::npos)
+        {
+            std::from_chars_result convResult = std::from_chars(addressView.data() + portSeparator + 1, addressView.data() + addressView.size(), replicaPort);
+            if(convResult.ec != std::errc() || replicaPort <= 0)
+            {
+                printf("ERR: Invalid replica address: %s\n", replicaAddress.c_str());
+                return 1;
+            }
+            addressView = addressView.substr(0, portSeparator);
+        }
+        mbase::gPostgreReplicaSet.add_replica(mbase::string(addressView.data(), addressView.size()), replicaPort);
+    }
+
     if(gSSLPublicPath.size() || gSSLPrivatePath.size())
     {
         gSSLEnabled = true;
     }
         
-    if(!gDBHostname.size() || !gDBName.size() || !gDBUsername.size())
+    if(!gDBHostname.size() || !gDBNames.size() || !gDBUsername.size())
     {
         printf("ERR: DB parameters must be supplied on program startup\n");
         printf("INFO: Make sure you provide the following parameters:\n");
@@ -460,24 +1544,18 @@ int main(int argc, char** argv)
     printf("INFO: Static schema option is specified\n");
     printf("INFO: Retrieving schema information from the database...\n");
 
-    mbase::PostgreSafeConnect postgreConnect(gDBHostname, gDBPort, gDBName, gDBUsername, gDBPassword);
-    if(!postgreConnect.isConnected())
-    {
-        printf("FATAL: Unable to connect to PostgreSQL database\n");
-        return 1;
-    }
-
-    if(!mbase::psql_get_all_tables(postgreConnect.get_connection_ptr()))
-    {
-        printf("FATAL: Unable to retrieve schema information from the database\n");
-        return 1;
-    }
-    printf("SUCCESS: Schema information succesfully retrieved!\n\n");
+    mbase::thread introspectionThread(schema_introspection_thread);
+    introspectionThread.run();
         
     bool triedBefore = false;
 
     while(1)
     {
+        if(gIsSchemaFailed)
+        {
+            exit(1);
+        }
+
         mbase::GgufMetaConfigurator ggufMetaConfig(mbase::from_utf8(gModelPath));
 
         if(!ggufMetaConfig.is_open())
@@ -524,6 +1602,13 @@ int main(int argc, char** argv)
     mbase::vector<char> loadingCharacters = {'\\', '|', '-', '/'};
     while(myModel.signal_initializing())
     {
+        if(gIsSchemaFailed)
+        {
+            // no reason to wait for the model, the server can't start without the schemas
+            printf("\n");
+            exit(1);
+        }
+
         for(char& n : loadingCharacters)
         {
             fflush(stdout);
@@ -532,12 +1617,32 @@ int main(int argc, char** argv)
         }
     }
     printf("\n");
+
+    // the schema block is built in the model initialization callback
+    introspectionThread.join();
+    if(!gIsSchemaRetrieved)
+    {
+        exit(1);
+    }
     myModel.update();
 
     gGlobalModel = &myModel;
 
     mbase::thread t1(server_thread);
     t1.run();
+    mbase::thread t2(db_maintenance_thread);
+    t2.run();
+    mbase::thread t3(schema_refresh_thread);
+    t3.run();
+    // a worker holds one processor and one pooled connection of the database its job is for
+    mbase::I32 jobWorkerCount = std::min(gUserCount, gDBPoolMaxSize) * (mbase::I32)gDatabases.size();
+    mbase::vector<mbase::thread<void(*)()>*> jobWorkers; // run as long as the program
+    for(mbase::I32 i = 0; i < jobWorkerCount; i++)
+    {
+        mbase::thread<void(*)()>* jobWorker = new mbase::thread<void(*)()>(job_worker_thread);
+        jobWorker->run();
+        jobWorkers.push_back(jobWorker);
+    }
     while(1)
     {
         gLoopSync.acquire();
@@ -6,10 +6,19 @@
 #include <mbase/inference/inf_t2t_processor.h>
 #include <mbase/inference/inf_t2t_client.h>
 #include <mbase/inference/inf_chat_templates.h>
+#include <mbase/map.h>
+#include <mbase/vector.h>
+#include <mbase/thread.h>
+#include <thread>
+#include <atomic>
+#include <filesystem>
 #include "global_state.h"
+#include "schema_snapshot.h"
 
 MBASE_BEGIN
 
+#define MBASE_NLQ_TOKENIZE_MIN_CHUNK 32768
+
 I32 gProcCounter = 1;
 
 class NlqClient;
@@ -94,13 +103,24 @@ private:
 
 class NlqProcessor : public InfProcessorTextToText {
 public:
+    NlqProcessor(nlq_database* in_database, const inf_text_token_vector& in_prompt_tokens, I32 in_generation) : mDatabase(in_database), mPromptTokens(in_prompt_tokens), mGeneration(in_generation)
+    {
+    }
 
-    GENERIC on_initialize() override
+    nlq_database* get_database() const
     {
-        mbase::inf_text_token_vector tokVec;
+        return mDatabase;
+    }
+
+    I32 get_generation() const
+    {
+        return mGeneration;
+    }
 
+    GENERIC on_initialize() override
+    {
         this->set_inference_client(&myClient);
-        this->execute_input(gSystemPromptTokens, true);
+        this->execute_input(mPromptTokens, true);
     }
 
 	GENERIC on_destroy() override
@@ -116,6 +136,9 @@ public:
 
 private:
     NlqClient myClient;
+    nlq_database* mDatabase;
+    inf_text_token_vector mPromptTokens;
+    I32 mGeneration;
 };
 
 class NlqModel : public InfModelTextToText {
@@ -137,7 +160,7 @@ public:
                 printf("\rINFO: KV-Caching the database schema information %c", n);
                 mbase::sleep(150);
             }
-            if(gLoadedProcessorCounter == mProcessorCount)
+            if(gLoadedProcessorCounter == mProcessorCount * (I32)gDatabases.size())
             {
                 break;
             }
@@ -163,21 +186,49 @@ public:
             exit(1);
         }
 
-        metaConfigurator.get_key("nlquery.tokens", gSystemPromptTokens);
+        metaConfigurator.get_key("nlquery.tokens", mInstructionTokens);
+        printf("SUCCESS: NLQuery configuration read!\n");
+
+        // the weights are shared, every database only adds the KV cache of its own processors
+        for(nlq_database* activeDatabase : gDatabases)
+        {
+            build_system_prompt(*activeDatabase, activeDatabase->mSystemPromptTokens);
+            printf("INFO: Calculated context size of %s is: %d\n", activeDatabase->mName.c_str(), activeDatabase->mSystemPromptTokens.size());
+            register_processors(*activeDatabase, activeDatabase->mSystemPromptTokens, activeDatabase->mGeneration, activeDatabase->mAvailableProcessors);
+        }
+        printf("SUCCESS: NLQuery configuration successfully applied!\n");
 
+        this->wait_prompt_caching();
+        // Initialize all processors
+    }
+
+    // System prompt of the current schema of io_database: instructions of the model file, the schema block and the hint file
+    GENERIC build_system_prompt(nlq_database& io_database, inf_text_token_vector& out_tokens)
+    {
+        // the schema map is ordered, so an unchanged schema keeps its place and its tokens in the prompt
         mbase::string dataSectionString = "<DB_SOURCE_BEGIN>\npostgresql\n<DB_SOURCE_END>\n<SCHEMA_LIST_BEGIN>\n";
-        for(auto& n : gSchemaTableMap)
+        for(auto& n : io_database.mSchemaTableMap)
         {
             dataSectionString += n.first + '\n';
         }
         dataSectionString += "<SCHEMA_LIST_END>\n";
-        for(auto& n : gSchemaTableMap)
+
+        // only the table info blocks that changed since the last build are tokenized
+        mbase::vector<mbase::string> schemaBlocks;
+        for(auto& n : io_database.mSchemaTableMap)
         {
-            mbase::string tableInfoString = mbase::string::from_format("<%s:TABLE_INFO_BEGIN>\n%s<%s:TABLE_INFO_END>\n", n.first.c_str(), n.second.c_str(), n.first.c_str());
-            dataSectionString += tableInfoString;
+            schemaBlocks.push_back(mbase::string::from_format("<%s:TABLE_INFO_BEGIN>\n%s<%s:TABLE_INFO_END>\n", n.first.c_str(), n.second.c_str(), n.first.c_str()));
         }
 
-        printf("SUCCESS: NLQuery configuration read!\n");
+        mbase::vector<const mbase::string*> changedBlocks;
+        changedBlocks.push_back(&dataSectionString);
+        for(const mbase::string& schemaBlock : schemaBlocks)
+        {
+            if(io_database.mBlockTokenCache.find(schemaBlock) == io_database.mBlockTokenCache.end())
+            {
+                changedBlocks.push_back(&schemaBlock);
+            }
+        }
 
         mbase::string systemStart;
         mbase::string assistantStart;
@@ -194,6 +245,34 @@ public:
             mbase::string hintText = mbase::read_file_as_string(gHintFilePath);
             systemEnd = hintText + systemEnd;
         }
+
+        // the inference SDK doesn't expose the vocabulary, the identity of the model file stands in for it
+        std::error_code fileError;
+        std::filesystem::path modelPath(gModelPath.c_str());
+        U64 modelSize = std::filesystem::file_size(modelPath, fileError);
+        I64 modelWriteTime = std::filesystem::last_write_time(modelPath, fileError).time_since_epoch().count();
+
+        U64 promptKey = 14695981039346656037ULL;
+        nlq_hash_append(promptKey, &modelSize, sizeof(modelSize));
+        nlq_hash_append(promptKey, &modelWriteTime, sizeof(modelWriteTime));
+        for(const inf_text_token& tmpToken : mInstructionTokens)
+        {
+            I32 instructionToken = (I32)tmpToken;
+            nlq_hash_append(promptKey, &instructionToken, sizeof(instructionToken));
+        }
+        nlq_hash_append(promptKey, systemStart.c_str(), systemStart.size());
+        nlq_hash_append(promptKey, dataSectionString.c_str(), dataSectionString.size());
+        for(const mbase::string& schemaBlock : schemaBlocks)
+        {
+            nlq_hash_append(promptKey, schemaBlock.c_str(), schemaBlock.size());
+        }
+        nlq_hash_append(promptKey, systemEnd.c_str(), systemEnd.size());
+
+        if(gEnableDbMetafile && nlq_read_prompt_cache(io_database.mName, promptKey, out_tokens))
+        {
+            printf("INFO: Reading the tokenized system prompt from the cache!\n");
+            return;
+        }
         
         mbase::inf_text_token_vector systemStartTokens;
         mbase::inf_text_token_vector dataSectionTokens;
@@ -205,12 +284,35 @@ public:
             printf("INFO: This should never happen, contact with the provider\n");
         }
 
-        if(this->tokenize_input(dataSectionString.c_str(), dataSectionString.size(), dataSectionTokens) != NlqModel::flags::INF_MODEL_SUCCESS)
+        mbase::vector<inf_text_token_vector> changedBlockTokens;
+        if(!this->tokenize_parallel(changedBlocks, changedBlockTokens))
         {
             printf("ERR: NLQuery configuration is corrupted!\n");
             printf("INFO: This should never happen, contact with the provider\n");
         }
 
+        // blocks of dropped schemas are forgotten
+        mbase::map<mbase::string, inf_text_token_vector> blockTokenCache;
+        for(size_type i = 1; i < changedBlocks.size(); ++i)
+        {
+            blockTokenCache[*changedBlocks[i]] = changedBlockTokens[i];
+        }
+
+        dataSectionTokens = changedBlockTokens[0];
+        for(const mbase::string& schemaBlock : schemaBlocks)
+        {
+            auto It = blockTokenCache.find(schemaBlock);
+            if(It == blockTokenCache.end())
+            {
+                It = blockTokenCache.insert({schemaBlock, io_database.mBlockTokenCache[schemaBlock]}).first;
+            }
+            for(const inf_text_token& tmpToken : It->second)
+            {
+                dataSectionTokens.push_back(tmpToken);
+            }
+        }
+        io_database.mBlockTokenCache = blockTokenCache;
+
         if(this->tokenize_input(systemEnd.c_str(), systemEnd.size(), systemEndTokens) != NlqModel::flags::INF_MODEL_SUCCESS)
         {
             printf("ERR: NLQuery configuration is corrupted!\n");
@@ -224,7 +326,7 @@ public:
             totalSystemPromptTokens.push_back(tmpToken);
         }
 
-        for(const inf_text_token& tmpToken : gSystemPromptTokens)
+        for(const inf_text_token& tmpToken : mInstructionTokens)
         {
             totalSystemPromptTokens.push_back(tmpToken);
         }
@@ -240,30 +342,33 @@ public:
             totalSystemPromptTokens.push_back(tmpToken);
         }
 
-        gSystemPromptTokens = totalSystemPromptTokens;
+        out_tokens = totalSystemPromptTokens;
+        if(gEnableDbMetafile && !nlq_write_prompt_cache(io_database.mName, promptKey, out_tokens))
+        {
+            printf("WARN: Unable to write the system prompt cache to %s\n", nlq_prompt_cache_path(io_database.mName).c_str());
+        }
+    }
 
-        printf("SUCCESS: NLQuery configuration successfully applied!\n");
-        printf("INFO: Calculated context size is: %d\n", gSystemPromptTokens.size());
+    // Registers a full set of processors for io_database which prefill and lock the given system prompt. Must be called under gLoopSync after startup.
+    GENERIC register_processors(nlq_database& io_database, const inf_text_token_vector& in_prompt_tokens, I32 in_generation, mbase::vector<NlqProcessor*>& out_processors)
+    {
         for(I32 i = 0; i < mProcessorCount; i++)
         {
-            NlqProcessor* newProcessor = new NlqProcessor; // Leak is fine, program will 24/7 run anyways
+            NlqProcessor* newProcessor = new NlqProcessor(&io_database, in_prompt_tokens, in_generation); // Leak is fine, program will 24/7 run anyways
 
             newProcessor->set_manual_caching(true, mbase::InfProcessorTextToText::cache_mode::KV_LOCK_MODE); // For system prompt caching
 
             this->register_context_process(
                 newProcessor,
-                gSystemPromptTokens.size() + 8192,
+                in_prompt_tokens.size() + 8192,
                 512,
                 16,
                 16,
                 true,
                 {} // by giving empty set, applying greedy sampling
             );
-            mAvailableProcessors.push_back(newProcessor);
+            out_processors.push_back(newProcessor);
         }
-        
-        this->wait_prompt_caching();
-        // Initialize all processors
     }
 
 	GENERIC on_destroy() override
@@ -271,31 +376,208 @@ public:
         // This will never be called
     }
 
-    bool acquire_processor(NlqProcessor*& out_processor)
+    /*
+        Tokenizes the given texts on all cores. Long texts are cut into pieces after a newline that is
+        followed by a non-space character; the pre-tokenizer never merges across such a point, so the tokens
+        are the same as tokenizing every text at once.
+    */
+    bool tokenize_parallel(const mbase::vector<const mbase::string*>& in_texts, mbase::vector<inf_text_token_vector>& out_tokens)
+    {
+        struct tokenize_piece {
+            size_type mTextIndex;
+            size_type mBegin;
+            size_type mEnd;
+            inf_text_token_vector mTokens;
+            bool bIsSucceeded = false;
+        };
+
+        mbase::vector<tokenize_piece> textPieces;
+        for(size_type textIndex = 0; textIndex < in_texts.size(); ++textIndex)
+        {
+            const mbase::string& pieceText = *in_texts[textIndex];
+            size_type chunkCount = pieceText.size() / MBASE_NLQ_TOKENIZE_MIN_CHUNK;
+            size_type pieceBegin = 0;
+            for(size_type i = 1; i < chunkCount; ++i)
+            {
+                size_type cutPosition = pieceText.find('\n', i * pieceText.size() / chunkCount);
+                while(cutPosition != mbase::string::npos && cutPosition + 1 < pieceText.size() && isspace((unsigned char)pieceText[cutPosition + 1]))
+                {
+                    cutPosition = pieceText.find('\n', cutPosition + 1);
+                }
+                if(cutPosition == mbase::string::npos || cutPosition + 1 >= pieceText.size())
+                {
+                    break;
+                }
+                if(cutPosition + 1 > pieceBegin)
+                {
+                    textPieces.push_back({textIndex, pieceBegin, cutPosition + 1});
+                    pieceBegin = cutPosition + 1;
+                }
+            }
+            textPieces.push_back({textIndex, pieceBegin, pieceText.size()});
+        }
+
+        size_type threadCount = std::thread::hardware_concurrency();
+        if(!threadCount || threadCount > textPieces.size())
+        {
+            threadCount = textPieces.size();
+        }
+
+        std::atomic<size_type> nextPiece = 0;
+        auto tokenizeWorker = [&]() {
+            for(size_type i = nextPiece++; i < textPieces.size(); i = nextPiece++)
+            {
+                tokenize_piece& textPiece = textPieces[i];
+                const char* pieceData = in_texts[textPiece.mTextIndex]->c_str() + textPiece.mBegin;
+                textPiece.bIsSucceeded = this->tokenize_input(pieceData, textPiece.mEnd - textPiece.mBegin, textPiece.mTokens) == NlqModel::flags::INF_MODEL_SUCCESS;
+            }
+        };
+
+        using tokenizer_thread = mbase::thread<decltype(tokenizeWorker)>;
+        mbase::vector<tokenizer_thread*> tokenizerThreads;
+        for(size_type i = 1; i < threadCount; ++i)
+        {
+            tokenizer_thread* tokenizerThread = new tokenizer_thread(tokenizeWorker);
+            tokenizerThread->run();
+            tokenizerThreads.push_back(tokenizerThread);
+        }
+        tokenizeWorker(); // the calling thread takes a share as well
+        for(tokenizer_thread* tokenizerThread : tokenizerThreads)
+        {
+            tokenizerThread->join();
+            delete tokenizerThread;
+        }
+
+        out_tokens.clear();
+        for(size_type i = 0; i < in_texts.size(); ++i)
+        {
+            out_tokens.push_back(inf_text_token_vector());
+        }
+        for(tokenize_piece& textPiece : textPieces)
+        {
+            if(!textPiece.bIsSucceeded)
+            {
+                return false;
+            }
+            for(const inf_text_token& tmpToken : textPiece.mTokens)
+            {
+                out_tokens[textPiece.mTextIndex].push_back(tmpToken);
+            }
+        }
+        return true;
+    }
+
+    // Processors of one database never serve another, each group holds its own system prompt
+    bool acquire_processor(nlq_database& io_database, NlqProcessor*& out_processor)
     {
         mbase::lock_guard lockGuard(mProcDistributionSync);
 
-        mbase::vector<NlqProcessor*>::iterator It = mAvailableProcessors.begin();
-        if(It == mAvailableProcessors.end())
+        mbase::vector<NlqProcessor*>::iterator It = io_database.mAvailableProcessors.begin();
+        if(It == io_database.mAvailableProcessors.end())
         {
             return false;
         }
         out_processor = *It;
-        mAvailableProcessors.erase(It);
+        io_database.mAvailableProcessors.erase(It);
         return true;
     }
 
     GENERIC release_processor(NlqProcessor* in_processor)
+    {
+        {
+            mbase::lock_guard lockGuard(mProcDistributionSync);
+            nlq_database* processorDatabase = in_processor->get_database();
+            if(in_processor->get_generation() == processorDatabase->mGeneration)
+            {
+                processorDatabase->mAvailableProcessors.push_back(in_processor);
+                return;
+            }
+        }
+        // the schema changed while this processor was generating
+        retire_processor(in_processor);
+    }
+
+    /*
+        Makes the given (already KV cached) processors the only ones that acquire_processor hands out.
+        Idle processors of the older generation are destroyed now, busy ones once they are released.
+    */
+    GENERIC swap_processors(nlq_database& io_database, mbase::vector<NlqProcessor*>& in_processors)
+    {
+        mbase::vector<NlqProcessor*> idleProcessors;
+        {
+            mbase::lock_guard lockGuard(mProcDistributionSync);
+            ++io_database.mGeneration;
+            idleProcessors = io_database.mAvailableProcessors;
+            io_database.mAvailableProcessors = in_processors;
+        }
+
+        for(NlqProcessor* oldProcessor : idleProcessors)
+        {
+            retire_processor(oldProcessor);
+        }
+    }
+
+    I32 get_free_processor_count(nlq_database& in_database)
+    {
+        mbase::lock_guard lockGuard(mProcDistributionSync);
+        return (I32)in_database.mAvailableProcessors.size();
+    }
+
+    I32 get_generation(nlq_database& in_database)
     {
         mbase::lock_guard lockGuard(mProcDistributionSync);
-    
-        mAvailableProcessors.push_back(in_processor);
+        return in_database.mGeneration;
+    }
+
+    I32 get_processor_count() const
+    {
+        return mProcessorCount;
     }
 
 private:
+    GENERIC retire_processor(NlqProcessor* in_processor)
+    {
+        // frees the context, the object itself is leaked like the rest
+        gLoopSync.acquire();
+        in_processor->destroy();
+        gLoopSync.release();
+    }
+
     mbase::mutex mProcDistributionSync;
-    mbase::vector<NlqProcessor*> mAvailableProcessors;
-    I32 mProcessorCount = 0;
+    inf_text_token_vector mInstructionTokens;
+    I32 mProcessorCount = 0; // per database
+};
+
+// Holds a processor of the given database until it goes out of scope, get() is null if all of them are busy
+class NlqProcessorLease {
+public:
+    NlqProcessorLease(NlqModel* in_model, nlq_database& in_database) : mModel(in_model)
+    {
+        if(!mModel->acquire_processor(in_database, mProcessor))
+        {
+            mProcessor = nullptr;
+        }
+    }
+
+    ~NlqProcessorLease()
+    {
+        if(mProcessor)
+        {
+            mModel->release_processor(mProcessor);
+        }
+    }
+
+    NlqProcessorLease(const NlqProcessorLease&) = delete;
+    NlqProcessorLease& operator=(const NlqProcessorLease&) = delete;
+
+    NlqProcessor* get()
+    {
+        return mProcessor;
+    }
+
+private:
+    NlqModel* mModel;
+    NlqProcessor* mProcessor = nullptr;
 };
 
 MBASE_END
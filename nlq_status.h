@@ -13,5 +13,52 @@
 #define NLQ_DB_ERR 7
 #define NLQ_INPUT_TOO_LONG 8
 #define NLQ_TOO_MUCH_DATA 9
+#define NLQ_EXPORT_NOT_READ_ONLY 10
+#define NLQ_CURSOR_NOT_FOUND 11
+#define NLQ_QUERY_TOO_EXPENSIVE 12
+#define NLQ_DATABASE_NOT_FOUND 13
+#define NLQ_JOB_NOT_FOUND 14
+#define NLQ_QUERY_NOT_READ_ONLY 15
+
+inline const char* nlq_status_message(int in_status_code)
+{
+    switch(in_status_code)
+    {
+    case NLQ_SUCCESS:
+        return "Success";
+    case NLQ_ENGINE_OVERLOADED:
+        return "NLQuery engine is overloaded. Try again later";
+    case NLQ_CONNECTION_FAILED:
+        return "Database connection failed";
+    case NLQ_PROMPT_INVALID:
+        return "Given query is invalid. Make sure it is natural language and its context is related to the SQL database";
+    case NLQ_INTERNAL_SERVER_ERROR:
+        return "Internal server error. Try again later";
+    case NLQ_INVALID_PAYLOAD:
+        return "Message body is invalid. Make sure you populate the mandatory fields correctly";
+    case NLQ_NOT_SUPPORTED:
+        return "Given database provider is not supported";
+    case NLQ_DB_ERR:
+        return "Database failed to execute the generated query";
+    case NLQ_INPUT_TOO_LONG:
+        return "Given prompt is too long. This may also happen if the provided sql_history is too long";
+    case NLQ_TOO_MUCH_DATA:
+        return "Too much data returned from the database";
+    case NLQ_EXPORT_NOT_READ_ONLY:
+        return "Only single read queries can be exported";
+    case NLQ_CURSOR_NOT_FOUND:
+        return "Continuation token is invalid, expired or already in use";
+    case NLQ_QUERY_TOO_EXPENSIVE:
+        return "Estimated cost of the generated query exceeds the server limit";
+    case NLQ_DATABASE_NOT_FOUND:
+        return "Given database is not served by this NLQuery instance";
+    case NLQ_JOB_NOT_FOUND:
+        return "Job id is invalid or its result has expired";
+    case NLQ_QUERY_NOT_READ_ONLY:
+        return "Only single read queries can be executed on this server";
+    default:
+        return "";
+    }
+}
 
 #endif // MBASE_NLQ_STATUS_H
\ No newline at end of file
@@ -0,0 +1,41 @@
+#ifndef MBASE_NLQ_REQUEST_ARENA_H
+#define MBASE_NLQ_REQUEST_ARENA_H
+
+#include <mbase/common.h>
+#include <memory_resource>
+
+MBASE_BEGIN
+
+#define MBASE_NLQ_ARENA_BLOCK_SIZE 65536
+
+/*
+    Per request bump allocator.
+    The first block belongs to the worker thread and is reused by every request it serves,
+    so a typical request doesn't touch the global allocator at all. Bigger requests grow into
+    heap blocks which are all released at once when the arena goes out of scope.
+
+    Only one arena may live on a thread at a time, and nothing allocated from it may outlive
+    the request handler (chunked content providers run after the handler returns).
+*/
+class NlqRequestArena {
+public:
+    NlqRequestArena() : mResource(tThreadBlock, sizeof(tThreadBlock), std::pmr::new_delete_resource())
+    {
+    }
+
+    NlqRequestArena(const NlqRequestArena&) = delete;
+    NlqRequestArena& operator=(const NlqRequestArena&) = delete;
+
+    std::pmr::memory_resource* get_resource()
+    {
+        return &mResource;
+    }
+
+private:
+    alignas(std::max_align_t) static inline thread_local char tThreadBlock[MBASE_NLQ_ARENA_BLOCK_SIZE];
+    std::pmr::monotonic_buffer_resource mResource;
+};
+
+MBASE_END
+
+#endif // MBASE_NLQ_REQUEST_ARENA_H
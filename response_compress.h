@@ -0,0 +1,295 @@
+#ifndef MBASE_NLQ_RESPONSE_COMPRESS_H
+#define MBASE_NLQ_RESPONSE_COMPRESS_H
+
+#include <mbase/common.h>
+#include <string>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef MBASE_NLQUERY_ZLIB_SUPPORT
+#include <zlib.h>
+#endif
+
+#ifdef MBASE_NLQUERY_ZSTD_SUPPORT
+#include <zstd.h>
+#endif
+
+MBASE_BEGIN
+
+/*
+    Response compression, done here instead of in httplib since httplib has no zstd and
+    only compresses whole bodies for set_content. Don't build with CPPHTTPLIB_ZLIB_SUPPORT,
+    the responses would be compressed twice.
+*/
+
+#define MBASE_NLQ_COMPRESS_BUFFER_SIZE 16384
+#define MBASE_NLQ_COMPRESS_SLICE_SIZE 65536
+#define MBASE_NLQ_GZIP_LEVEL 6
+#define MBASE_NLQ_ZSTD_LEVEL 3
+
+enum class nlq_content_encoding : U8 {
+    IDENTITY,
+    GZIP,
+    ZSTD
+};
+
+inline const char* nlq_encoding_name(nlq_content_encoding in_encoding)
+{
+    switch(in_encoding)
+    {
+    case nlq_content_encoding::GZIP: return "gzip";
+    case nlq_content_encoding::ZSTD: return "zstd";
+    default: return "identity";
+    }
+}
+
+inline bool nlq_is_encoding_supported(nlq_content_encoding in_encoding)
+{
+    switch(in_encoding)
+    {
+#ifdef MBASE_NLQUERY_ZLIB_SUPPORT
+    case nlq_content_encoding::GZIP: return true;
+#endif
+#ifdef MBASE_NLQUERY_ZSTD_SUPPORT
+    case nlq_content_encoding::ZSTD: return true;
+#endif
+    default: return in_encoding == nlq_content_encoding::IDENTITY;
+    }
+}
+
+/*
+    Picks the encoding with the highest q-value in the Accept-Encoding header among the compiled in ones.
+    zstd wins ties since it is both faster and smaller on our payloads.
+*/
+inline nlq_content_encoding nlq_negotiate_encoding(const std::string& in_accept_encoding)
+{
+    nlq_content_encoding selectedEncoding = nlq_content_encoding::IDENTITY;
+    F64 selectedQuality = 0;
+    F64 wildcardQuality = -1;
+    F64 encodingQualities[3] = {-1, -1, -1};
+
+    size_type tokenStart = 0;
+    while(tokenStart < in_accept_encoding.size())
+    {
+        size_type tokenEnd = in_accept_encoding.find(',', tokenStart);
+        if(tokenEnd == std::string::npos)
+        {
+            tokenEnd = in_accept_encoding.size();
+        }
+
+        std::string encodingToken = in_accept_encoding.substr(tokenStart, tokenEnd - tokenStart);
+        tokenStart = tokenEnd + 1;
+
+        F64 tokenQuality = 1;
+        size_type paramStart = encodingToken.find(';');
+        if(paramStart != std::string::npos)
+        {
+            size_type qualityStart = encodingToken.find("q=", paramStart);
+            if(qualityStart != std::string::npos)
+            {
+                tokenQuality = strtod(encodingToken.c_str() + qualityStart + 2, nullptr);
+            }
+            encodingToken.resize(paramStart);
+        }
+
+        // trim and lower the coding name
+        std::string codingName;
+        for(char tokenChar : encodingToken)
+        {
+            if(tokenChar != ' ' && tokenChar != '\t')
+            {
+                codingName += (tokenChar >= 'A' && tokenChar <= 'Z') ? (char)(tokenChar + ('a' - 'A')) : tokenChar;
+            }
+        }
+
+        if(codingName == "gzip" || codingName == "x-gzip")
+        {
+            encodingQualities[(I32)nlq_content_encoding::GZIP] = tokenQuality;
+        }
+        else if(codingName == "zstd")
+        {
+            encodingQualities[(I32)nlq_content_encoding::ZSTD] = tokenQuality;
+        }
+        else if(codingName == "*")
+        {
+            wildcardQuality = tokenQuality;
+        }
+    }
+
+    nlq_content_encoding encodingPreference[] = {nlq_content_encoding::ZSTD, nlq_content_encoding::GZIP};
+    for(nlq_content_encoding candidateEncoding : encodingPreference)
+    {
+        F64 candidateQuality = encodingQualities[(I32)candidateEncoding];
+        if(candidateQuality < 0)
+        {
+            candidateQuality = wildcardQuality;
+        }
+
+        if(nlq_is_encoding_supported(candidateEncoding) && candidateQuality > selectedQuality)
+        {
+            selectedEncoding = candidateEncoding;
+            selectedQuality = candidateQuality;
+        }
+    }
+    return selectedEncoding;
+}
+
+/*
+    Streaming compressor for chunked responses.
+    Every chunk is flushed so that the client can decode the rows that are sent so far,
+    only the compressor window is kept between chunks.
+*/
+class NlqStreamCompressor {
+public:
+    NlqStreamCompressor(nlq_content_encoding in_encoding) : mEncoding(in_encoding)
+    {
+#ifdef MBASE_NLQUERY_ZLIB_SUPPORT
+        if(mEncoding == nlq_content_encoding::GZIP)
+        {
+            memset(&mZlibStream, 0, sizeof(mZlibStream));
+            // 16 + window bits selects the gzip wrapper
+            bIsReady = deflateInit2(&mZlibStream, MBASE_NLQ_GZIP_LEVEL, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+        }
+#endif
+#ifdef MBASE_NLQUERY_ZSTD_SUPPORT
+        if(mEncoding == nlq_content_encoding::ZSTD)
+        {
+            mZstdContext = ZSTD_createCCtx();
+            bIsReady = mZstdContext && !ZSTD_isError(ZSTD_CCtx_setParameter(mZstdContext, ZSTD_c_compressionLevel, MBASE_NLQ_ZSTD_LEVEL));
+        }
+#endif
+    }
+
+    ~NlqStreamCompressor()
+    {
+#ifdef MBASE_NLQUERY_ZLIB_SUPPORT
+        if(mEncoding == nlq_content_encoding::GZIP && bIsReady)
+        {
+            deflateEnd(&mZlibStream);
+        }
+#endif
+#ifdef MBASE_NLQUERY_ZSTD_SUPPORT
+        if(mZstdContext)
+        {
+            ZSTD_freeCCtx(mZstdContext);
+        }
+#endif
+    }
+
+    NlqStreamCompressor(const NlqStreamCompressor&) = delete;
+    NlqStreamCompressor& operator=(const NlqStreamCompressor&) = delete;
+
+    // Replaces io_chunk with its compressed form, in_last writes the end of the compressed stream
+    bool process(std::string& io_chunk, bool in_last)
+    {
+        if(mEncoding == nlq_content_encoding::IDENTITY)
+        {
+            return true;
+        }
+
+        if(!bIsReady)
+        {
+            return false;
+        }
+
+        mOutput.clear();
+        bool isCompressed = false;
+#ifdef MBASE_NLQUERY_ZLIB_SUPPORT
+        if(mEncoding == nlq_content_encoding::GZIP)
+        {
+            isCompressed = deflate_chunk(io_chunk, in_last);
+        }
+#endif
+#ifdef MBASE_NLQUERY_ZSTD_SUPPORT
+        if(mEncoding == nlq_content_encoding::ZSTD)
+        {
+            isCompressed = zstd_chunk(io_chunk, in_last);
+        }
+#endif
+        io_chunk.swap(mOutput);
+        return isCompressed;
+    }
+
+private:
+#ifdef MBASE_NLQUERY_ZLIB_SUPPORT
+    bool deflate_chunk(const std::string& in_chunk, bool in_last)
+    {
+        char outputBuffer[MBASE_NLQ_COMPRESS_BUFFER_SIZE];
+        mZlibStream.next_in = (Bytef*)in_chunk.data();
+        mZlibStream.avail_in = (uInt)in_chunk.size();
+        I32 flushMode = in_last ? Z_FINISH : Z_SYNC_FLUSH;
+        do
+        {
+            mZlibStream.next_out = (Bytef*)outputBuffer;
+            mZlibStream.avail_out = sizeof(outputBuffer);
+            I32 deflateResult = deflate(&mZlibStream, flushMode);
+            if(deflateResult == Z_STREAM_ERROR)
+            {
+                return false;
+            }
+            mOutput.append(outputBuffer, sizeof(outputBuffer) - mZlibStream.avail_out);
+        } while(mZlibStream.avail_out == 0);
+        return true;
+    }
+#endif
+
+#ifdef MBASE_NLQUERY_ZSTD_SUPPORT
+    bool zstd_chunk(const std::string& in_chunk, bool in_last)
+    {
+        char outputBuffer[MBASE_NLQ_COMPRESS_BUFFER_SIZE];
+        ZSTD_inBuffer zstdInput = {in_chunk.data(), in_chunk.size(), 0};
+        ZSTD_EndDirective endMode = in_last ? ZSTD_e_end : ZSTD_e_flush;
+        size_type remainingBytes = 0;
+        do
+        {
+            ZSTD_outBuffer zstdOutput = {outputBuffer, sizeof(outputBuffer), 0};
+            remainingBytes = ZSTD_compressStream2(mZstdContext, &zstdOutput, &zstdInput, endMode);
+            if(ZSTD_isError(remainingBytes))
+            {
+                return false;
+            }
+            mOutput.append(outputBuffer, zstdOutput.pos);
+        } while(remainingBytes);
+        return true;
+    }
+#endif
+
+    nlq_content_encoding mEncoding;
+    std::string mOutput;
+    bool bIsReady = false;
+#ifdef MBASE_NLQUERY_ZLIB_SUPPORT
+    z_stream mZlibStream;
+#endif
+#ifdef MBASE_NLQUERY_ZSTD_SUPPORT
+    ZSTD_CCtx* mZstdContext = nullptr;
+#endif
+};
+
+// Hands out an already built response body in slices, so that it can be compressed as a stream
+class NlqBufferedBody {
+public:
+    NlqBufferedBody(std::string&& in_body) : mBody(std::move(in_body))
+    {
+    }
+
+    bool next_chunk(std::string& out_chunk)
+    {
+        size_type sliceLength = mBody.size() - mOffset < MBASE_NLQ_COMPRESS_SLICE_SIZE ? mBody.size() - mOffset : MBASE_NLQ_COMPRESS_SLICE_SIZE;
+        out_chunk.append(mBody, mOffset, sliceLength);
+        mOffset += sliceLength;
+        return mOffset < mBody.size();
+    }
+
+    size_type size() const
+    {
+        return mBody.size();
+    }
+
+private:
+    std::string mBody;
+    size_type mOffset = 0;
+};
+
+MBASE_END
+
+#endif // MBASE_NLQ_RESPONSE_COMPRESS_H
@@ -0,0 +1,155 @@
+#ifndef MBASE_NLQ_RESULT_STREAM_H
+#define MBASE_NLQ_RESULT_STREAM_H
+
+#include <mbase/common.h>
+#include <mbase/string.h>
+#include <memory>
+#include <string>
+#include "db_ops.h"
+#include "result_writer.h"
+
+MBASE_BEGIN
+
+#define MBASE_NLQ_STREAM_CHUNK_SIZE 65536
+
+/*
+    Produces the body of a chunked /nlquery response for a query that is already sent.
+    The SQL goes out in the first chunk, before the database returns anything.
+    Since the status is only known at the end, it is the last member (JSON) or the last line (NDJSON).
+*/
+class PsqlResultStream {
+public:
+    enum class stream_format {
+        JSON, // the documented column-major document, rows are buffered up to the row limit
+        NDJSON // row-major lines written as the rows arrive
+    };
+
+    PsqlResultStream(std::unique_ptr<PostgrePooledConnection>&& in_connection, const mbase::string& in_sql, I32 in_max_rows, stream_format in_format, const nlq_output_options& in_options) :
+        mConnection(std::move(in_connection)),
+        mResultReader(mConnection->get_connection_ptr(), in_max_rows),
+        mSql(in_sql),
+        mFormat(in_format),
+        mOptions(in_options)
+    {
+    }
+
+    ~PsqlResultStream()
+    {
+        if(!bIsFinished)
+        {
+            // client went away in the middle of the stream, the pool closes the busy connection
+            psql_cancel_query(mConnection->get_connection_ptr());
+        }
+    }
+
+    PsqlResultStream(const PsqlResultStream&) = delete;
+    PsqlResultStream& operator=(const PsqlResultStream&) = delete;
+
+    // Appends the next piece of the body to out_chunk. Returns false once the body is complete.
+    bool next_chunk(std::string& out_chunk)
+    {
+        if(bIsFinished)
+        {
+            return false;
+        }
+
+        if(!bIsStarted)
+        {
+            bIsStarted = true;
+            if(mFormat == stream_format::NDJSON)
+            {
+                nlq_write_ndjson_sql(out_chunk, mSql);
+            }
+            else
+            {
+                out_chunk += "{\"sql\":";
+                json_append_string(out_chunk, mSql.c_str(), mSql.size());
+                out_chunk += ',';
+            }
+            return true;
+        }
+
+        bool isNewSet = false;
+        while(out_chunk.size() < MBASE_NLQ_STREAM_CHUNK_SIZE)
+        {
+            PGresult* resultBatch = mResultReader.next(isNewSet);
+            if(!resultBatch)
+            {
+                write_trailer(out_chunk);
+                bIsFinished = true;
+                return false;
+            }
+
+            if(mFormat == stream_format::NDJSON)
+            {
+                if(isNewSet)
+                {
+                    psql_resolve_decoders(resultBatch, mDecoders);
+                    nlq_write_ndjson_columns(out_chunk, mDecoders);
+                }
+                nlq_write_ndjson_rows(out_chunk, mDecoders, resultBatch);
+                mRowCount += PQntuples(resultBatch);
+                PQclear(resultBatch);
+            }
+            else
+            {
+                if(isNewSet)
+                {
+                    mResultRows.begin_result_set(resultBatch);
+                }
+
+                if(PQntuples(resultBatch))
+                {
+                    mResultRows.push(resultBatch);
+                }
+                else
+                {
+                    PQclear(resultBatch);
+                }
+            }
+        }
+        return true;
+    }
+
+private:
+    GENERIC write_trailer(std::string& out_chunk)
+    {
+        I32 resultStatus = mResultReader.get_status();
+        if(mFormat == stream_format::NDJSON)
+        {
+            out_chunk += '{';
+            nlq_write_json_status(out_chunk, resultStatus);
+            if(resultStatus == NLQ_SUCCESS)
+            {
+                out_chunk += ",\"rows\":";
+                json_append_i64(out_chunk, mRowCount);
+            }
+            out_chunk += "}\n";
+            return;
+        }
+
+        if(resultStatus == NLQ_SUCCESS && mResultReader.has_result_set())
+        {
+            out_chunk.reserve(out_chunk.size() + nlq_estimate_json_size(mResultRows));
+            nlq_write_json_data(out_chunk, mResultRows, mOptions);
+            out_chunk += ',';
+        }
+        nlq_write_json_status(out_chunk, resultStatus);
+        out_chunk += '}';
+    }
+
+    std::unique_ptr<PostgrePooledConnection> mConnection;
+    PsqlResultReader mResultReader;
+    PsqlResultBuffer mResultRows;
+    mbase::vector<psql_column_decoder> mDecoders;
+    mbase::string mSql;
+    stream_format mFormat;
+    nlq_output_options mOptions;
+    I64 mRowCount = 0;
+    bool bIsStarted = false;
+    bool bIsFinished = false;
+};
+
+MBASE_END
+
+#endif // MBASE_NLQ_RESULT_STREAM_H
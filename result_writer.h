@@ -0,0 +1,325 @@
+#ifndef MBASE_NLQ_RESULT_WRITER_H
+#define MBASE_NLQ_RESULT_WRITER_H
+
+#include <mbase/common.h>
+#include <mbase/string.h>
+#include <mbase/vector.h>
+#include <libpq-fe.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <memory_resource>
+#include "db_decode.h"
+#include "json_writer.h"
+#include "nlq_status.h"
+
+MBASE_BEGIN
+
+/*
+    Owns the PGresult batches of the result set that is being returned.
+    Rows are kept in the libpq buffers they arrived in; nothing is copied until the response is written.
+*/
+class PsqlResultBuffer {
+public:
+    PsqlResultBuffer() = default;
+    PsqlResultBuffer(const PsqlResultBuffer&) = delete;
+    PsqlResultBuffer& operator=(const PsqlResultBuffer&) = delete;
+
+    ~PsqlResultBuffer()
+    {
+        clear();
+    }
+
+    GENERIC clear()
+    {
+        for(PGresult* resultBatch : mBatches)
+        {
+            PQclear(resultBatch);
+        }
+        mBatches.clear();
+        mDecoders.clear();
+        mRowCount = 0;
+        mPayloadSize = 0;
+    }
+
+    // Starts a new result set, decoders are resolved from the first result of the set
+    GENERIC begin_result_set(const PGresult* in_result)
+    {
+        clear();
+        psql_resolve_decoders(in_result, mDecoders);
+    }
+
+    // Takes the ownership of the result
+    GENERIC push(PGresult* in_result)
+    {
+        I32 batchRows = PQntuples(in_result);
+        for(I32 j = 0; j < batchRows; ++j)
+        {
+            for(I32 i = 0; i < (I32)mDecoders.size(); ++i)
+            {
+                mPayloadSize += PQgetlength(in_result, j, i);
+            }
+        }
+        mRowCount += batchRows;
+        mBatches.push_back(in_result);
+    }
+
+    I32 get_row_count() const
+    {
+        return mRowCount;
+    }
+
+    size_type get_payload_size() const
+    {
+        return mPayloadSize;
+    }
+
+    const mbase::vector<psql_column_decoder>& get_decoders() const
+    {
+        return mDecoders;
+    }
+
+    const mbase::vector<PGresult*>& get_batches() const
+    {
+        return mBatches;
+    }
+
+private:
+    mbase::vector<PGresult*> mBatches;
+    mbase::vector<psql_column_decoder> mDecoders;
+    I32 mRowCount = 0;
+    size_type mPayloadSize = 0;
+};
+
+struct nlq_output_options {
+    bool bIsArrow = false; // arrow IPC stream instead of JSON for result sets
+    bool bIsDictEncoded = false; // low cardinality string columns as {"dict":[...],"codes":[...]}
+};
+
+/*
+    Writes a string column as {"dict":["value_1",...],"codes":[0,1,0,null,...]}.
+    Dictionary keys point into the PGresult buffers, so nothing is copied while the dictionary is built.
+    Returns false without writing anything if less than half of the values are repeats.
+*/
+inline bool nlq_write_json_dict_column(std::string& out_body, const PsqlResultBuffer& in_rows, const psql_column_decoder& in_decoder, std::pmr::memory_resource* in_arena)
+{
+    size_type maxDistinct = in_rows.get_row_count() / 2;
+    std::pmr::unordered_map<std::string_view, I32> dictIndex(in_arena);
+    std::pmr::vector<std::string_view> dictValues(in_arena);
+    std::pmr::vector<I32> valueCodes(in_arena);
+    dictIndex.reserve(maxDistinct < 1024 ? maxDistinct : 1024);
+    valueCodes.reserve(in_rows.get_row_count());
+
+    for(const PGresult* resultBatch : in_rows.get_batches())
+    {
+        I32 batchRows = PQntuples(resultBatch);
+        for(I32 j = 0; j < batchRows; ++j)
+        {
+            if(PQgetisnull(resultBatch, j, in_decoder.mColumnIndex))
+            {
+                valueCodes.push_back(-1);
+                continue;
+            }
+
+            std::string_view cellValue(PQgetvalue(resultBatch, j, in_decoder.mColumnIndex), PQgetlength(resultBatch, j, in_decoder.mColumnIndex));
+            std::pair<std::pmr::unordered_map<std::string_view, I32>::iterator, bool> insertResult = dictIndex.emplace(cellValue, (I32)dictValues.size());
+            if(insertResult.second)
+            {
+                if(dictValues.size() == maxDistinct)
+                {
+                    return false;
+                }
+                dictValues.push_back(cellValue);
+            }
+            valueCodes.push_back(insertResult.first->second);
+        }
+    }
+
+    out_body += "{\"dict\":[";
+    for(size_type i = 0; i < dictValues.size(); ++i)
+    {
+        if(i)
+        {
+            out_body += ',';
+        }
+        json_append_string(out_body, dictValues[i].data(), dictValues[i].size());
+    }
+
+    out_body += "],\"codes\":[";
+    for(size_type i = 0; i < valueCodes.size(); ++i)
+    {
+        if(i)
+        {
+            out_body += ',';
+        }
+
+        if(valueCodes[i] < 0)
+        {
+            out_body += "null";
+        }
+        else
+        {
+            json_append_i64(out_body, valueCodes[i]);
+        }
+    }
+    out_body += "]}";
+    return true;
+}
+
+// Writes "data":{"col_1":[...],...,"col_n":[...]} column by column, straight from the buffered batches
+inline GENERIC nlq_write_json_data(std::string& out_body, const PsqlResultBuffer& in_rows, const nlq_output_options& in_options, std::pmr::memory_resource* in_arena = std::pmr::get_default_resource())
+{
+    out_body += "\"data\":{";
+    bool isFirstColumn = true;
+    for(const psql_column_decoder& columnDecoder : in_rows.get_decoders())
+    {
+        if(!isFirstColumn)
+        {
+            out_body += ',';
+        }
+        isFirstColumn = false;
+        json_append_string(out_body, columnDecoder.mName.c_str(), columnDecoder.mName.size());
+        out_body += ':';
+        if(in_options.bIsDictEncoded && columnDecoder.mKind == psql_value_kind::TEXT && nlq_write_json_dict_column(out_body, in_rows, columnDecoder, in_arena))
+        {
+            continue;
+        }
+        out_body += '[';
+
+        bool isFirstRow = true;
+        for(const PGresult* resultBatch : in_rows.get_batches())
+        {
+            I32 batchRows = PQntuples(resultBatch);
+            for(I32 j = 0; j < batchRows; ++j)
+            {
+                if(!isFirstRow)
+                {
+                    out_body += ',';
+                }
+                isFirstRow = false;
+                psql_write_json_cell(columnDecoder, resultBatch, j, out_body);
+            }
+        }
+        out_body += ']';
+    }
+    out_body += '}';
+}
+
+inline size_type nlq_estimate_json_size(const PsqlResultBuffer& in_rows)
+{
+    // raw payload plus quotes, separators and some escaping headroom per cell
+    return in_rows.get_payload_size() + (size_type)in_rows.get_row_count() * in_rows.get_decoders().size() * 4;
+}
+
+/*
+    Writes the documented response in a single pass:
+    {"status":0,"sql":"...","data":{"col_1":[...],...,"col_n":[...]}}
+    "data" is omitted if in_rows is null (modifying queries and generate only requests).
+*/
+inline GENERIC nlq_write_json_response(std::string& out_body, const mbase::string& in_sql, const PsqlResultBuffer* in_rows, const nlq_output_options& in_options, std::pmr::memory_resource* in_arena = std::pmr::get_default_resource())
+{
+    out_body.clear();
+    out_body.reserve(in_sql.size() + 64 + (in_rows ? nlq_estimate_json_size(*in_rows) : 0));
+
+    out_body += "{\"status\":";
+    json_append_i64(out_body, NLQ_SUCCESS);
+    out_body += ",\"sql\":";
+    json_append_string(out_body, in_sql.c_str(), in_sql.size());
+
+    if(in_rows)
+    {
+        out_body += ',';
+        nlq_write_json_data(out_body, *in_rows, in_options, in_arena);
+    }
+    out_body += '}';
+}
+
+/*
+    A page read from a cursor: {"status":0[,"sql":"..."],"data":{...}[,"next_token":"..."]}
+    The SQL is only sent with the first page, next_token is left out on the last one.
+*/
+inline GENERIC nlq_write_json_page(std::string& out_body, const mbase::string* in_sql, const PsqlResultBuffer& in_rows, const mbase::string& in_next_token, const nlq_output_options& in_options, std::pmr::memory_resource* in_arena = std::pmr::get_default_resource())
+{
+    out_body.clear();
+    out_body.reserve((in_sql ? in_sql->size() : 0) + in_next_token.size() + 64 + nlq_estimate_json_size(in_rows));
+
+    out_body += "{\"status\":";
+    json_append_i64(out_body, NLQ_SUCCESS);
+    if(in_sql)
+    {
+        out_body += ",\"sql\":";
+        json_append_string(out_body, in_sql->c_str(), in_sql->size());
+    }
+    out_body += ',';
+    nlq_write_json_data(out_body, in_rows, in_options, in_arena);
+
+    if(in_next_token.size())
+    {
+        out_body += ",\"next_token\":";
+        json_append_string(out_body, in_next_token.c_str(), in_next_token.size());
+    }
+    out_body += '}';
+}
+
+/*
+    NDJSON (row-major) lines:
+    {"sql":"..."}                 first line, as soon as the SQL is generated
+    {"columns":["col_1",...]}     once per result set
+    [value_1,...,value_n]         one line per row, as the rows arrive
+    {"status":0,"rows":n}         last line, or {"status":#code,"message":"..."} on failure
+*/
+inline GENERIC nlq_write_ndjson_sql(std::string& out_body, const mbase::string& in_sql)
+{
+    out_body += "{\"sql\":";
+    json_append_string(out_body, in_sql.c_str(), in_sql.size());
+    out_body += "}\n";
+}
+
+inline GENERIC nlq_write_ndjson_columns(std::string& out_body, const mbase::vector<psql_column_decoder>& in_decoders)
+{
+    out_body += "{\"columns\":[";
+    for(size_type i = 0; i < in_decoders.size(); ++i)
+    {
+        if(i)
+        {
+            out_body += ',';
+        }
+        json_append_string(out_body, in_decoders[i].mName.c_str(), in_decoders[i].mName.size());
+    }
+    out_body += "]}\n";
+}
+
+inline GENERIC nlq_write_ndjson_rows(std::string& out_body, const mbase::vector<psql_column_decoder>& in_decoders, const PGresult* in_result)
+{
+    I32 batchRows = PQntuples(in_result);
+    for(I32 j = 0; j < batchRows; ++j)
+    {
+        out_body += '[';
+        for(size_type i = 0; i < in_decoders.size(); ++i)
+        {
+            if(i)
+            {
+                out_body += ',';
+            }
+            psql_write_json_cell(in_decoders[i], in_result, j, out_body);
+        }
+        out_body += "]\n";
+    }
+}
+
+// Status members of a response, without the enclosing braces: "status":#code[,"message":"..."]
+inline GENERIC nlq_write_json_status(std::string& out_body, I32 in_status)
+{
+    out_body += "\"status\":";
+    json_append_i64(out_body, in_status);
+    if(in_status != NLQ_SUCCESS)
+    {
+        const char* statusMessage = nlq_status_message(in_status);
+        out_body += ",\"message\":";
+        json_append_string(out_body, statusMessage, strlen(statusMessage));
+    }
+}
+
+MBASE_END
+
+#endif // MBASE_NLQ_RESULT_WRITER_H
@@ -0,0 +1,86 @@
+#ifndef MBASE_NLQ_SCHEMA_REFRESH_H
+#define MBASE_NLQ_SCHEMA_REFRESH_H
+
+#include <mbase/common.h>
+#include <mbase/string.h>
+#include <mbase/vector.h>
+#include "global_state.h"
+#include "db_ops.h"
+#include "model_proc_cl.h"
+
+MBASE_BEGIN
+
+/*
+    Brings the processors of io_database up to date with its catalog.
+    If the catalog fingerprint changed (or in_force is set), the schema is introspected again and a new
+    generation of processors prefills the new system prompt in the background. Requests keep being served
+    by the old generation until the new one is swapped in. Both generations hold a KV cache in the meantime.
+
+    Only one thread may run this at a time, whichever database it refreshes, since the prefill counter is shared.
+*/
+bool nlq_refresh_schema(NlqModel* in_model, nlq_database& io_database, bool in_force)
+{
+    PostgreSafeConnect postgreConnect(gDBHostname, gDBPort, io_database.mName, gDBUsername, gDBPassword);
+    if(!postgreConnect.isConnected())
+    {
+        printf("ERR: Schema refresh is unable to connect to the database %s\n", io_database.mName.c_str());
+        return false;
+    }
+
+    mbase::string catalogFingerprint;
+    if(!psql_get_schema_fingerprint(postgreConnect.get_connection_ptr(), catalogFingerprint))
+    {
+        printf("ERR: Schema refresh is unable to read the catalog\n");
+        return false;
+    }
+
+    if(!in_force && catalogFingerprint == io_database.mSchemaFingerprint)
+    {
+        return true;
+    }
+
+    printf("INFO: Schema of %s has changed, refreshing...\n", io_database.mName.c_str());
+    mbase::map<mbase::string, mbase::string> oldSchemaTableMap = io_database.mSchemaTableMap;
+    mbase::unordered_map<mbase::string, mbase::vector<table_relation_meta>> oldTableRelations = io_database.mCachedTableRelations;
+    io_database.mSchemaTableMap.clear();
+    io_database.mCachedTableRelations.clear();
+    if(!psql_get_all_tables(postgreConnect.get_connection_ptr(), io_database, catalogFingerprint, false))
+    {
+        printf("ERR: Schema refresh is unable to retrieve schema information, keeping the old schema\n");
+        io_database.mSchemaTableMap = oldSchemaTableMap;
+        io_database.mCachedTableRelations = oldTableRelations;
+        return false;
+    }
+
+    inf_text_token_vector promptTokens;
+    in_model->build_system_prompt(io_database, promptTokens);
+
+    mbase::vector<NlqProcessor*> newProcessors;
+    gLoopSync.acquire();
+    gLoadedProcessorCounter = 0;
+    in_model->register_processors(io_database, promptTokens, in_model->get_generation(io_database) + 1, newProcessors);
+    gLoopSync.release();
+
+    // the main loop drives the prefill
+    while(1)
+    {
+        gLoopSync.acquire();
+        bool isCached = gLoadedProcessorCounter >= in_model->get_processor_count();
+        gLoopSync.release();
+        if(isCached)
+        {
+            break;
+        }
+        mbase::sleep(150);
+    }
+
+    in_model->swap_processors(io_database, newProcessors);
+    io_database.mSystemPromptTokens = promptTokens;
+    io_database.mSchemaFingerprint = catalogFingerprint;
+    printf("SUCCESS: Schema of %s refreshed, new context size is: %d\n", io_database.mName.c_str(), (I32)promptTokens.size());
+    return true;
+}
+
+MBASE_END
+
+#endif // MBASE_NLQ_SCHEMA_REFRESH_H
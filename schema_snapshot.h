@@ -0,0 +1,449 @@
+#ifndef MBASE_NLQ_SCHEMA_SNAPSHOT_H
+#define MBASE_NLQ_SCHEMA_SNAPSHOT_H
+
+#include <mbase/common.h>
+#include <mbase/string.h>
+#include <mbase/vector.h>
+#include <mbase/unordered_map.h>
+#include <string>
+#include <vector>
+#include <string_view>
+#include <cstdio>
+#include <cstring>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include <mbase/inference/inf_common.h>
+#include "global_state.h"
+
+MBASE_BEGIN
+
+/*
+    Binary schema metadata cache written by --enable-dbmeta-file.
+
+    header | U32 string offsets[string count + 1] | tables | relations | string bytes
+
+    Every name is stored once and referred to by its index. The file is mapped and read in place,
+    it is only used if its fingerprint equals the fingerprint of the live catalog.
+*/
+
+#define MBASE_NLQ_SNAPSHOT_MAGIC "NLQMETA"
+#define MBASE_NLQ_SNAPSHOT_VERSION 1
+#define MBASE_NLQ_SNAPSHOT_FILE "schema_meta.nlqs"
+
+struct nlq_snapshot_header {
+    char mMagic[8];
+    U32 mVersion;
+    U32 mStringCount;
+    U32 mTableCount;
+    U32 mRelationCount;
+    U32 mStringBytes;
+    U32 mFingerprint; // string index
+};
+
+struct nlq_snapshot_table {
+    U32 mSchemaName;
+    U32 mTableName;
+    U32 mFirstRelation;
+    U32 mRelationCount;
+};
+
+struct nlq_snapshot_relation {
+    U32 mColumnName;
+    U32 mColumnDataType;
+    U32 mConstraintName;
+    U32 mReferenceTable;
+    U32 mReferenceColumn;
+};
+
+/*
+    Cache files of a database are prefixed with its name. Characters that may not be valid in a file name
+    are replaced, a clash of two names only costs cache misses since the contents are validated on read.
+*/
+inline mbase::string nlq_database_file_path(const mbase::string& in_dbname, const char* in_file_name)
+{
+    mbase::string outPath = gProgramPath + "/";
+    for(char nameChar : in_dbname)
+    {
+        bool isSafe = (nameChar >= 'a' && nameChar <= 'z') || (nameChar >= 'A' && nameChar <= 'Z') || (nameChar >= '0' && nameChar <= '9') || nameChar == '_' || nameChar == '-';
+        outPath += isSafe ? nameChar : '_';
+    }
+    outPath += '.';
+    outPath += in_file_name;
+    return outPath;
+}
+
+inline mbase::string nlq_snapshot_path(const mbase::string& in_dbname)
+{
+    return nlq_database_file_path(in_dbname, MBASE_NLQ_SNAPSHOT_FILE);
+}
+
+// Written next to the final path first, so that a reader never maps a half written file
+inline bool nlq_replace_file(const mbase::string& in_path, const std::string& in_content)
+{
+    mbase::string temporaryPath = in_path + ".tmp";
+    FILE* outputFile = fopen(temporaryPath.c_str(), "wb");
+    if(!outputFile)
+    {
+        return false;
+    }
+    bool isWritten = fwrite(in_content.data(), 1, in_content.size(), outputFile) == in_content.size();
+    isWritten = fclose(outputFile) == 0 && isWritten;
+#ifdef _WIN32
+    isWritten = isWritten && MoveFileExA(temporaryPath.c_str(), in_path.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+    isWritten = isWritten && rename(temporaryPath.c_str(), in_path.c_str()) == 0;
+#endif
+    if(!isWritten)
+    {
+        remove(temporaryPath.c_str());
+    }
+    return isWritten;
+}
+
+// Read only mapping of a whole file
+class NlqMappedFile {
+public:
+    NlqMappedFile() = default;
+    NlqMappedFile(const NlqMappedFile&) = delete;
+    NlqMappedFile& operator=(const NlqMappedFile&) = delete;
+
+    ~NlqMappedFile()
+    {
+#ifdef _WIN32
+        if(mData)
+        {
+            UnmapViewOfFile(mData);
+        }
+        if(mMapping)
+        {
+            CloseHandle(mMapping);
+        }
+        if(mFile != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(mFile);
+        }
+#else
+        if(mData)
+        {
+            munmap((void*)mData, mSize);
+        }
+#endif
+    }
+
+    bool open(const mbase::string& in_path)
+    {
+#ifdef _WIN32
+        mFile = CreateFileA(in_path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        LARGE_INTEGER fileSize;
+        if(mFile == INVALID_HANDLE_VALUE || !GetFileSizeEx(mFile, &fileSize) || !fileSize.QuadPart)
+        {
+            return false;
+        }
+        mMapping = CreateFileMappingA(mFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if(!mMapping)
+        {
+            return false;
+        }
+        mData = (const char*)MapViewOfFile(mMapping, FILE_MAP_READ, 0, 0, 0);
+        mSize = (size_type)fileSize.QuadPart;
+#else
+        I32 fileDescriptor = ::open(in_path.c_str(), O_RDONLY);
+        if(fileDescriptor < 0)
+        {
+            return false;
+        }
+        struct stat fileStat;
+        if(fstat(fileDescriptor, &fileStat) != 0 || !fileStat.st_size)
+        {
+            close(fileDescriptor);
+            return false;
+        }
+        void* mappedData = mmap(nullptr, fileStat.st_size, PROT_READ, MAP_PRIVATE, fileDescriptor, 0);
+        close(fileDescriptor); // the mapping stays valid
+        if(mappedData == MAP_FAILED)
+        {
+            return false;
+        }
+        mData = (const char*)mappedData;
+        mSize = fileStat.st_size;
+#endif
+        return mData != nullptr;
+    }
+
+    const char* data() const
+    {
+        return mData;
+    }
+
+    size_type size() const
+    {
+        return mSize;
+    }
+
+private:
+    const char* mData = nullptr;
+    size_type mSize = 0;
+#ifdef _WIN32
+    HANDLE mFile = INVALID_HANDLE_VALUE;
+    HANDLE mMapping = nullptr;
+#endif
+};
+
+// A mapped snapshot, every offset and index is validated once in open so that the accessors don't need to
+class NlqSchemaSnapshot {
+public:
+    bool open(const mbase::string& in_path)
+    {
+        if(!mFile.open(in_path) || mFile.size() < sizeof(nlq_snapshot_header))
+        {
+            return false;
+        }
+
+        memcpy(&mHeader, mFile.data(), sizeof(mHeader));
+        if(memcmp(mHeader.mMagic, MBASE_NLQ_SNAPSHOT_MAGIC, sizeof(MBASE_NLQ_SNAPSHOT_MAGIC)) || mHeader.mVersion != MBASE_NLQ_SNAPSHOT_VERSION)
+        {
+            return false;
+        }
+
+        U64 offsetsSize = ((U64)mHeader.mStringCount + 1) * sizeof(U32);
+        U64 tablesSize = (U64)mHeader.mTableCount * sizeof(nlq_snapshot_table);
+        U64 relationsSize = (U64)mHeader.mRelationCount * sizeof(nlq_snapshot_relation);
+        if(sizeof(nlq_snapshot_header) + offsetsSize + tablesSize + relationsSize + mHeader.mStringBytes != mFile.size())
+        {
+            return false;
+        }
+
+        mStringOffsets = (const U32*)(mFile.data() + sizeof(nlq_snapshot_header));
+        mTables = (const nlq_snapshot_table*)((const char*)mStringOffsets + offsetsSize);
+        mRelations = (const nlq_snapshot_relation*)((const char*)mTables + tablesSize);
+        mStrings = (const char*)mRelations + relationsSize;
+
+        for(U32 i = 0; i < mHeader.mStringCount; ++i)
+        {
+            if(mStringOffsets[i] > mStringOffsets[i + 1])
+            {
+                return false;
+            }
+        }
+        if(mStringOffsets[mHeader.mStringCount] != mHeader.mStringBytes || !is_string(mHeader.mFingerprint))
+        {
+            return false;
+        }
+
+        for(U32 i = 0; i < mHeader.mTableCount; ++i)
+        {
+            const nlq_snapshot_table& snapshotTable = mTables[i];
+            if(!is_string(snapshotTable.mSchemaName) || !is_string(snapshotTable.mTableName) || (U64)snapshotTable.mFirstRelation + snapshotTable.mRelationCount > mHeader.mRelationCount)
+            {
+                return false;
+            }
+        }
+
+        for(U32 i = 0; i < mHeader.mRelationCount; ++i)
+        {
+            const nlq_snapshot_relation& snapshotRelation = mRelations[i];
+            if(!is_string(snapshotRelation.mColumnName) || !is_string(snapshotRelation.mColumnDataType) || !is_string(snapshotRelation.mConstraintName) ||
+                !is_string(snapshotRelation.mReferenceTable) || !is_string(snapshotRelation.mReferenceColumn))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::string_view get_string(U32 in_index) const
+    {
+        return std::string_view(mStrings + mStringOffsets[in_index], mStringOffsets[in_index + 1] - mStringOffsets[in_index]);
+    }
+
+    std::string_view get_fingerprint() const
+    {
+        return get_string(mHeader.mFingerprint);
+    }
+
+    U32 get_table_count() const
+    {
+        return mHeader.mTableCount;
+    }
+
+    const nlq_snapshot_table& get_table(U32 in_index) const
+    {
+        return mTables[in_index];
+    }
+
+    const nlq_snapshot_relation& get_relation(U32 in_index) const
+    {
+        return mRelations[in_index];
+    }
+
+private:
+    bool is_string(U32 in_index) const
+    {
+        return in_index < mHeader.mStringCount;
+    }
+
+    NlqMappedFile mFile;
+    nlq_snapshot_header mHeader;
+    const U32* mStringOffsets = nullptr;
+    const nlq_snapshot_table* mTables = nullptr;
+    const nlq_snapshot_relation* mRelations = nullptr;
+    const char* mStrings = nullptr;
+};
+
+class NlqSchemaSnapshotWriter {
+public:
+    GENERIC add_table(const mbase::string& in_schema_name, const mbase::string& in_table_name, const mbase::vector<table_relation_meta>& in_relations)
+    {
+        nlq_snapshot_table snapshotTable;
+        snapshotTable.mSchemaName = intern(in_schema_name);
+        snapshotTable.mTableName = intern(in_table_name);
+        snapshotTable.mFirstRelation = (U32)mRelations.size();
+        snapshotTable.mRelationCount = (U32)in_relations.size();
+        mTables.push_back(snapshotTable);
+
+        for(const table_relation_meta& trm : in_relations)
+        {
+            nlq_snapshot_relation snapshotRelation;
+            snapshotRelation.mColumnName = intern(trm.columnName);
+            snapshotRelation.mColumnDataType = intern(trm.columnDataType);
+            snapshotRelation.mConstraintName = intern(trm.constraintName);
+            snapshotRelation.mReferenceTable = intern(trm.referenceTable);
+            snapshotRelation.mReferenceColumn = intern(trm.referenceColumn);
+            mRelations.push_back(snapshotRelation);
+        }
+    }
+
+    bool write(const mbase::string& in_path, const mbase::string& in_fingerprint)
+    {
+        nlq_snapshot_header snapshotHeader;
+        memset(&snapshotHeader, 0, sizeof(snapshotHeader));
+        memcpy(snapshotHeader.mMagic, MBASE_NLQ_SNAPSHOT_MAGIC, sizeof(MBASE_NLQ_SNAPSHOT_MAGIC));
+        snapshotHeader.mVersion = MBASE_NLQ_SNAPSHOT_VERSION;
+        snapshotHeader.mFingerprint = intern(in_fingerprint);
+        snapshotHeader.mStringCount = (U32)mStringOffsets.size();
+        snapshotHeader.mTableCount = (U32)mTables.size();
+        snapshotHeader.mRelationCount = (U32)mRelations.size();
+        snapshotHeader.mStringBytes = (U32)mStringBytes.size();
+
+        std::string snapshotBody((const char*)&snapshotHeader, sizeof(snapshotHeader));
+        snapshotBody.append((const char*)mStringOffsets.data(), mStringOffsets.size() * sizeof(U32));
+        U32 stringsEnd = (U32)mStringBytes.size();
+        snapshotBody.append((const char*)&stringsEnd, sizeof(stringsEnd));
+        snapshotBody.append((const char*)mTables.data(), mTables.size() * sizeof(nlq_snapshot_table));
+        snapshotBody.append((const char*)mRelations.data(), mRelations.size() * sizeof(nlq_snapshot_relation));
+        snapshotBody += mStringBytes;
+
+        return nlq_replace_file(in_path, snapshotBody);
+    }
+
+private:
+    U32 intern(const mbase::string& in_string)
+    {
+        auto It = mStringIndices.find(in_string);
+        if(It != mStringIndices.end())
+        {
+            return It->second;
+        }
+        U32 stringIndex = (U32)mStringOffsets.size();
+        mStringOffsets.push_back((U32)mStringBytes.size());
+        mStringBytes.append(in_string.c_str(), in_string.size());
+        mStringIndices[in_string] = stringIndex;
+        return stringIndex;
+    }
+
+    mbase::unordered_map<mbase::string, U32> mStringIndices;
+    std::vector<U32> mStringOffsets;
+    std::string mStringBytes;
+    std::vector<nlq_snapshot_table> mTables;
+    std::vector<nlq_snapshot_relation> mRelations;
+};
+
+/*
+    Tokenized system prompt, stored next to the metadata snapshot.
+    header | I32 tokens[token count]
+    The key covers everything the prompt is built from, a prompt is only read back for an identical key.
+*/
+
+#define MBASE_NLQ_PROMPT_CACHE_MAGIC "NLQTOKS"
+#define MBASE_NLQ_PROMPT_CACHE_VERSION 1
+#define MBASE_NLQ_PROMPT_CACHE_FILE "system_prompt.nlqt"
+
+struct nlq_prompt_cache_header {
+    char mMagic[8];
+    U32 mVersion;
+    U32 mTokenCount;
+    U64 mKey;
+};
+
+inline mbase::string nlq_prompt_cache_path(const mbase::string& in_dbname)
+{
+    return nlq_database_file_path(in_dbname, MBASE_NLQ_PROMPT_CACHE_FILE);
+}
+
+// 64 bit FNV-1a, the length goes in first so that consecutive fields can't be confused
+inline GENERIC nlq_hash_append(U64& io_hash, const void* in_data, size_type in_size)
+{
+    U64 sizeField = in_size;
+    const U8* fieldBytes[2] = { (const U8*)&sizeField, (const U8*)in_data };
+    size_type fieldSizes[2] = { sizeof(sizeField), in_size };
+    for(I32 i = 0; i < 2; ++i)
+    {
+        for(size_type j = 0; j < fieldSizes[i]; ++j)
+        {
+            io_hash = (io_hash ^ fieldBytes[i][j]) * 1099511628211ULL;
+        }
+    }
+}
+
+inline bool nlq_read_prompt_cache(const mbase::string& in_dbname, U64 in_key, inf_text_token_vector& out_tokens)
+{
+    NlqMappedFile cacheFile;
+    if(!cacheFile.open(nlq_prompt_cache_path(in_dbname)) || cacheFile.size() < sizeof(nlq_prompt_cache_header))
+    {
+        return false;
+    }
+
+    nlq_prompt_cache_header cacheHeader;
+    memcpy(&cacheHeader, cacheFile.data(), sizeof(cacheHeader));
+    if(memcmp(cacheHeader.mMagic, MBASE_NLQ_PROMPT_CACHE_MAGIC, sizeof(MBASE_NLQ_PROMPT_CACHE_MAGIC)) || cacheHeader.mVersion != MBASE_NLQ_PROMPT_CACHE_VERSION ||
+        cacheHeader.mKey != in_key || sizeof(cacheHeader) + (U64)cacheHeader.mTokenCount * sizeof(I32) != cacheFile.size())
+    {
+        return false;
+    }
+
+    const I32* cachedTokens = (const I32*)(cacheFile.data() + sizeof(cacheHeader));
+    out_tokens.clear();
+    for(U32 i = 0; i < cacheHeader.mTokenCount; ++i)
+    {
+        out_tokens.push_back((inf_text_token)cachedTokens[i]);
+    }
+    return true;
+}
+
+inline bool nlq_write_prompt_cache(const mbase::string& in_dbname, U64 in_key, const inf_text_token_vector& in_tokens)
+{
+    nlq_prompt_cache_header cacheHeader;
+    memset(&cacheHeader, 0, sizeof(cacheHeader));
+    memcpy(cacheHeader.mMagic, MBASE_NLQ_PROMPT_CACHE_MAGIC, sizeof(MBASE_NLQ_PROMPT_CACHE_MAGIC));
+    cacheHeader.mVersion = MBASE_NLQ_PROMPT_CACHE_VERSION;
+    cacheHeader.mTokenCount = (U32)in_tokens.size();
+    cacheHeader.mKey = in_key;
+
+    std::string cacheBody((const char*)&cacheHeader, sizeof(cacheHeader));
+    for(const inf_text_token& tmpToken : in_tokens)
+    {
+        I32 storedToken = (I32)tmpToken;
+        cacheBody.append((const char*)&storedToken, sizeof(storedToken));
+    }
+    return nlq_replace_file(nlq_prompt_cache_path(in_dbname), cacheBody);
+}
+
+MBASE_END
+
+#endif // MBASE_NLQ_SCHEMA_SNAPSHOT_H
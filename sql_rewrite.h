@@ -0,0 +1,208 @@
+#ifndef MBASE_NLQ_SQL_REWRITE_H
+#define MBASE_NLQ_SQL_REWRITE_H
+
+#include <mbase/common.h>
+#include <mbase/string.h>
+#include <mbase/vector.h>
+#include <cstring>
+
+MBASE_BEGIN
+
+struct sql_statement_info {
+    mbase::string mStatement; // trimmed, without the trailing semicolons
+    mbase::string mLeadingKeyword; // lower case
+    bool bIsMultiStatement = false;
+    bool bIsReadOnly = false; // a single SELECT/WITH/VALUES/TABLE statement without data modifying parts, row locks or known writing functions
+};
+
+inline bool sql_is_ident_char(char in_char)
+{
+    return (in_char >= 'a' && in_char <= 'z') || (in_char >= 'A' && in_char <= 'Z') || (in_char >= '0' && in_char <= '9') || in_char == '_' || in_char == '$';
+}
+
+inline bool sql_is_space(char in_char)
+{
+    return in_char == ' ' || in_char == '\n' || in_char == '\t' || in_char == '\r' || in_char == '\f' || in_char == '\v';
+}
+
+/*
+    Lexical inspection of the generated SQL. It skips string literals, quoted identifiers,
+    dollar quoted bodies and comments, and looks at the keywords that are left.
+    It doesn't parse the statement; it only has to be good enough to decide
+    whether the statement can safely be wrapped or routed as a read.
+*/
+inline GENERIC sql_inspect_statement(const mbase::string& in_sql, sql_statement_info& out_info)
+{
+    out_info = sql_statement_info();
+
+    size_type sqlLength = in_sql.size();
+    const char* sqlText = in_sql.c_str();
+    size_type statementStart = 0;
+    size_type statementEnd = 0; // one past the last significant character of the first statement
+    bool hasWriteKeyword = false;
+    bool isFirstStatementDone = false;
+    I32 parenDepth = 0;
+    mbase::string previousWord;
+
+    for(size_type i = 0; i < sqlLength;)
+    {
+        char currentChar = sqlText[i];
+        if(sql_is_space(currentChar))
+        {
+            i++;
+            continue;
+        }
+
+        // comments are skipped before the end of the first statement is checked, "SELECT ...; -- note" is a single statement
+        if(currentChar == '-' && i + 1 < sqlLength && sqlText[i + 1] == '-')
+        {
+            while(i < sqlLength && sqlText[i] != '\n')
+            {
+                i++;
+            }
+            continue;
+        }
+
+        if(currentChar == '/' && i + 1 < sqlLength && sqlText[i + 1] == '*')
+        {
+            size_type commentEnd = in_sql.find("*/", i + 2);
+            i = commentEnd == mbase::string::npos ? sqlLength : commentEnd + 2;
+            continue;
+        }
+
+        if(isFirstStatementDone)
+        {
+            if(currentChar == ';')
+            {
+                i++;
+                continue;
+            }
+            out_info.bIsMultiStatement = true;
+            break;
+        }
+
+        if(currentChar == '\'' || currentChar == '"')
+        {
+            // doubled quotes are escapes, they just restart the same literal
+            bool isEscapeString = currentChar == '\'' && i && (sqlText[i - 1] == 'E' || sqlText[i - 1] == 'e');
+            size_type j = i + 1;
+            while(j < sqlLength && sqlText[j] != currentChar)
+            {
+                if(isEscapeString && sqlText[j] == '\\' && j + 1 < sqlLength)
+                {
+                    j++;
+                }
+                j++;
+            }
+            i = j < sqlLength ? j + 1 : sqlLength;
+            statementEnd = i;
+            continue;
+        }
+
+        if(currentChar == '$')
+        {
+            size_type tagEnd = i + 1;
+            while(tagEnd < sqlLength && sql_is_ident_char(sqlText[tagEnd]) && sqlText[tagEnd] != '$')
+            {
+                tagEnd++;
+            }
+
+            if(tagEnd < sqlLength && sqlText[tagEnd] == '$' && !(sqlText[i + 1] >= '0' && sqlText[i + 1] <= '9'))
+            {
+                mbase::string dollarTag(sqlText + i, tagEnd - i + 1);
+                size_type bodyEnd = in_sql.find(dollarTag, tagEnd + 1);
+                i = bodyEnd == mbase::string::npos ? sqlLength : bodyEnd + dollarTag.size();
+                statementEnd = i;
+                continue;
+            }
+        }
+
+        if(!statementEnd)
+        {
+            statementStart = i;
+        }
+
+        if(currentChar == ';' && !parenDepth)
+        {
+            isFirstStatementDone = true;
+            i++;
+            continue;
+        }
+
+        if(currentChar == '(')
+        {
+            parenDepth++;
+        }
+
+        else if(currentChar == ')' && parenDepth)
+        {
+            parenDepth--;
+        }
+
+        else if(sql_is_ident_char(currentChar))
+        {
+            size_type wordStart = i;
+            while(i < sqlLength && sql_is_ident_char(sqlText[i]))
+            {
+                i++;
+            }
+            mbase::string currentWord(sqlText + wordStart, i - wordStart);
+            currentWord.to_lower();
+
+            if(!out_info.mLeadingKeyword.size())
+            {
+                out_info.mLeadingKeyword = currentWord;
+            }
+
+            if(currentWord == "insert" || currentWord == "update" || currentWord == "delete" || currentWord == "merge" || currentWord == "into" || currentWord == "truncate")
+            {
+                // also catches data modifying CTEs, SELECT INTO and FOR UPDATE / FOR NO KEY UPDATE
+                hasWriteKeyword = true;
+            }
+
+            else if(currentWord == "share" && (previousWord == "for" || previousWord == "key"))
+            {
+                // FOR SHARE / FOR KEY SHARE take row locks, which hot standbys and read only transactions refuse
+                hasWriteKeyword = true;
+            }
+
+            else if(currentWord == "nextval" || currentWord == "setval" || currentWord == "set_config" || !strncmp(currentWord.c_str(), "pg_advisory", 11))
+            {
+                // functions that write or change the session even when they are called from a SELECT
+                hasWriteKeyword = true;
+            }
+            previousWord = currentWord;
+            statementEnd = i;
+            continue;
+        }
+        i++;
+        statementEnd = i;
+    }
+
+    if(statementEnd > statementStart)
+    {
+        out_info.mStatement = mbase::string(sqlText + statementStart, statementEnd - statementStart);
+    }
+    const mbase::string& leadingKeyword = out_info.mLeadingKeyword;
+    bool isReadKeyword = leadingKeyword == "select" || leadingKeyword == "with" || leadingKeyword == "values" || leadingKeyword == "table";
+    out_info.bIsReadOnly = isReadKeyword && !hasWriteKeyword && !out_info.bIsMultiStatement;
+}
+
+/*
+    Wraps a read only statement so that PostgreSQL stops producing rows after in_row_limit + 1 rows.
+    The extra row is what lets the caller notice that the limit was exceeded.
+    Anything that is not a single read statement is returned untouched.
+*/
+inline mbase::string sql_apply_row_limit(const sql_statement_info& in_info, const mbase::string& in_sql, I32 in_row_limit)
+{
+    if(!in_info.bIsReadOnly || in_row_limit <= 0)
+    {
+        return in_sql;
+    }
+    // new lines are there so that a trailing line comment can't swallow the closing parenthesis
+    return "SELECT * FROM (\n" + in_info.mStatement + mbase::string::from_format("\n) nlq_limited LIMIT %d", in_row_limit + 1);
+}
+
+MBASE_END
+
+#endif // MBASE_NLQ_SQL_REWRITE_H